@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Link benchmark: goodput of a download at each baud rate, for 128-byte
+# frames, 1K frames (-k) and 1K frames with a transmit window (-k -w 4).
+#
+# The link is the simulated loopback device (no hardware involved), with
+# 2 ms of round-trip latency, similar to a USB-serial bridge. Real UARTs add
+# their own latency and errors: use the figures to compare settings, not as
+# the throughput of an actual board.
+#
+# Usage: bench_link.sh [dfu-util-qda] [image size]
+
+BIN=${1:-./dfu-util-qda}
+SIZE=${2:-50000}
+RATES="115200 230400 460800 921600 1500000 2000000 3000000"
+DEVICE="loopback:latency=2000,window,maxbaud=3000000"
+
+IMAGE=$(mktemp) || exit 1
+trap 'rm -f "$IMAGE"' EXIT
+head -c "$SIZE" /dev/urandom > "$IMAGE" || exit 1
+
+goodput()
+{
+	"$BIN" -p "$DEVICE" -s "$1" -D "$IMAGE" -v $2 2>&1 |
+	    sed -n 's/^Goodput: .*(\([0-9]*\) bytes\/s)$/\1/p'
+}
+
+echo "Loopback goodput (bytes/s) for a $SIZE-byte download"
+printf "%8s %16s %16s %16s\n" "baud" "128-byte frames" "-k (1K frames)" \
+    "-k -w 4"
+for rate in $RATES; do
+	printf "%8s %16s %16s %16s\n" "$rate" "$(goodput "$rate" "")" \
+	    "$(goodput "$rate" "-k")" "$(goodput "$rate" "-k -w 4")"
+done
@@ -162,14 +162,21 @@ void *dfu_malloc(size_t size)
 	return (ptr);
 }
 
-uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
+uint32_t dfu_file_crc(uint32_t crc, const void *buf, int size)
 {
 	int x;
 
-	/* compute CRC */
 	for (x = 0; x != size; x++)
 		crc = crc32_byte(crc, ((uint8_t *)buf)[x]);
 
+	return (crc);
+}
+
+uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size)
+{
+	/* compute CRC */
+	crc = dfu_file_crc(crc, buf, size);
+
 	/* write data */
 	if (write(f, buf, size) != size)
 		err(EX_IOERR, "Could not write %d bytes to file %d", size, f);
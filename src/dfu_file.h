@@ -54,6 +54,7 @@ void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix);
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
 void *dfu_malloc(size_t size);
+uint32_t dfu_file_crc(uint32_t crc, const void *buf, int size);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
 void show_suffix_and_prefix(struct dfu_file *file);
 
@@ -0,0 +1,176 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "portable.h"
+#include "dfu_file.h"
+#include "dfu_journal.h"
+
+#define JOURNAL_NAME ".dfu-util-qda-journal"
+
+/* Maximum number of entries kept in the journal file */
+#define JOURNAL_MAX_ENTRIES 32
+
+/* Minimum time between two writes of the journal file, in seconds */
+#define JOURNAL_SYNC_INTERVAL 1
+
+/* Length of a journal line: the numbers, the port and the line feed */
+#define JOURNAL_LINE_MAX (DFU_JOURNAL_PORT_MAX + 64)
+
+/*
+ * Parse a journal line: "<size> <crc> <offset> <port>".
+ *
+ * Returns 1 if the line is the entry of the journal, 0 otherwise.
+ */
+static int journal_match(const struct dfu_journal *j, const char *line,
+    int *offset)
+{
+	unsigned int crc;
+	int size;
+	int n;
+
+	if (sscanf(line, "%d %x %d %n", &size, &crc, offset, &n) != 3)
+		return 0;
+	if (size != j->size || crc != j->crc)
+		return 0;
+	if (strcspn(line + n, "\n") != strlen(j->port) ||
+	    strncmp(line + n, j->port, strlen(j->port)))
+		return 0;
+	return 1;
+}
+
+int dfu_journal_open(struct dfu_journal *j, const char *port,
+    const uint8_t *image, int size)
+{
+	char line[JOURNAL_LINE_MAX];
+	const char *home;
+	FILE *f;
+	int offset;
+
+	home = getenv("HOME");
+	snprintf(j->path, sizeof(j->path), "%s%s" JOURNAL_NAME,
+	    home ? home : "", home ? "/" : "");
+	snprintf(j->port, sizeof(j->port), "%s", port);
+	j->size = size;
+	j->crc = dfu_file_crc(0xffffffff, image, size);
+	j->offset = 0;
+	j->saved = 0;
+	j->dirty = 0;
+
+	f = fopen(j->path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (journal_match(j, line, &offset) && offset > 0 &&
+		    offset <= size) {
+			j->offset = offset;
+			break;
+		}
+	}
+	fclose(f);
+
+	return j->offset;
+}
+
+/*
+ * Write the entry of the journal (or remove it if the offset is 0).
+ */
+static void journal_write(struct dfu_journal *j)
+{
+	char lines[JOURNAL_MAX_ENTRIES][JOURNAL_LINE_MAX];
+	char tmp[DFU_JOURNAL_PATH_MAX + 4];
+	int offset = j->offset;
+	int count = 0;
+	int dummy;
+	FILE *f;
+	int ret;
+	int i;
+
+	j->saved = time(NULL);
+	j->dirty = 0;
+
+	/* Keep the entries of other downloads */
+	f = fopen(j->path, "r");
+	if (f) {
+		while (count < JOURNAL_MAX_ENTRIES - 1 &&
+		    fgets(lines[count], sizeof(lines[count]), f)) {
+			if (!journal_match(j, lines[count], &dummy))
+				count++;
+		}
+		fclose(f);
+	}
+	if (offset == 0 && count == 0) {
+		remove(j->path);
+		return;
+	}
+
+	/*
+	 * Write a new journal next to the old one and rename it over it, so
+	 * that a crash leaves either of them, never a truncated file
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		warnx("Cannot write journal %s", tmp);
+		return;
+	}
+	for (i = 0; i < count; i++)
+		fputs(lines[i], f);
+	if (offset)
+		fprintf(f, "%d %08x %d %s\n", j->size, (unsigned int)j->crc,
+		    offset, j->port);
+	ret = fflush(f);
+#ifdef HAVE_FSYNC
+	if (ret == 0)
+		ret = fsync(fileno(f));
+#endif
+	if (fclose(f) != 0 || ret != 0) {
+		warnx("Cannot write journal %s", tmp);
+		remove(tmp);
+		return;
+	}
+#ifdef HAVE_WINDOWS_H
+	/* rename() does not replace an existing file there */
+	remove(j->path);
+#endif
+	if (rename(tmp, j->path) != 0) {
+		warnx("Cannot update journal %s", j->path);
+		remove(tmp);
+	}
+}
+
+void dfu_journal_update(struct dfu_journal *j, int offset)
+{
+	j->offset = offset;
+	/* A synced write per block would slow fast links down */
+	if (offset && time(NULL) - j->saved < JOURNAL_SYNC_INTERVAL) {
+		j->dirty = 1;
+		return;
+	}
+	journal_write(j);
+}
+
+void dfu_journal_flush(struct dfu_journal *j)
+{
+	if (j->dirty)
+		journal_write(j);
+}
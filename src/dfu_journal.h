@@ -0,0 +1,78 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef DFU_JOURNAL_H
+#define DFU_JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Maximum length of the journal path and of a port name */
+#define DFU_JOURNAL_PATH_MAX 1024
+#define DFU_JOURNAL_PORT_MAX 256
+
+/*
+ * Download journal.
+ *
+ * It records how much of an image was acknowledged by the device, so that an
+ * interrupted download can be resumed, within a run or by a later run. Each
+ * entry is keyed by the port and by the length and CRC of the image; the
+ * journal file holds one entry per line.
+ */
+struct dfu_journal {
+	/* Path of the journal file */
+	char path[DFU_JOURNAL_PATH_MAX];
+	/* Key of the entry */
+	char port[DFU_JOURNAL_PORT_MAX];
+	int size;
+	uint32_t crc;
+	/* Number of bytes acknowledged by the device */
+	int offset;
+	/* Time of the last write of the file, and whether it is out of date */
+	time_t saved;
+	int dirty;
+};
+
+/*
+ * Open the journal entry of a download.
+ *
+ * The journal file is $HOME/.dfu-util-qda-journal (or in the current
+ * directory if HOME is not set).
+ *
+ * Returns the number of bytes of the image already acknowledged by the
+ * device (0 if there is no entry).
+ */
+int dfu_journal_open(struct dfu_journal *j, const char *port,
+    const uint8_t *image, int size);
+
+/*
+ * Record the number of bytes acknowledged by the device; 0 removes the entry
+ * (e.g., once the download is complete).
+ *
+ * The file is written at most once a second, except to remove the entry: see
+ * dfu_journal_flush().
+ */
+void dfu_journal_update(struct dfu_journal *j, int offset);
+
+/*
+ * Write the last recorded offset to the file, if it has not been yet (e.g.,
+ * when a download fails).
+ */
+void dfu_journal_flush(struct dfu_journal *j);
+
+#endif /* DFU_JOURNAL_H */
@@ -47,6 +47,7 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
+#include "dfu_journal.h"
 #include "quirks.h"
 
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
@@ -74,6 +75,13 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
 
 		dfu_file_write_crc(fd, 0, buf, rc);
 		total_bytes += rc;
+#ifdef USE_QDA
+		if (qda_adapt_link(dif->dev_handle) < 0) {
+			warnx("Device lost while changing the link speed");
+			ret = -1;
+			goto out_free;
+		}
+#endif
 
 		if (total_bytes < 0)
 			errx(EX_SOFTWARE, "Received too many bytes (wraparound)");
@@ -94,12 +102,17 @@ out_free:
 	free(buf);
 	if (verbose)
 		printf("Received a total of %i bytes\n", total_bytes);
+#ifdef USE_QDA
+	if (verbose)
+		qda_report_stats(dif->dev_handle);
+#endif
 	if (expected_size != 0 && total_bytes != expected_size)
 		errx(EX_SOFTWARE, "Unexpected number of bytes uploaded from device");
 	return ret;
 }
 
-int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
+int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
+    struct dfu_journal *journal)
 {
 	int bytes_sent;
 	int expected_size;
@@ -107,12 +120,34 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 	unsigned short transaction = 0;
 	struct dfu_status dst;
 	int ret;
+#ifdef USE_QDA
+	int delta;
+	int skipped = 0;
+	int resume_from = 0;
+#endif
 
 	printf("Copying data from PC to DFU device\n");
 
 	buf = file->firmware;
 	expected_size = file->size.total - file->size.suffix;
 	bytes_sent = 0;
+#ifdef USE_QDA
+	delta = qda_dfu_delta_begin(dif->dev_handle, xfer_size, expected_size);
+	if (journal && journal->offset) {
+		/*
+		 * Blocks before the checkpoint are still checked against
+		 * their CRC on the device, as it may have changed since
+		 */
+		if (qda_dfu_can_skip(dif->dev_handle)) {
+			resume_from = journal->offset / xfer_size;
+			printf("Resuming download at block %i (%i bytes "
+			    "acknowledged)\n", resume_from, journal->offset);
+		} else {
+			printf("Device cannot resume downloads, starting "
+			    "over\n");
+		}
+	}
+#endif
 
 	dfu_progress_bar("Download", 0, 1);
 	while (bytes_sent < expected_size) {
@@ -125,6 +160,25 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 		else
 			chunk_size = xfer_size;
 
+#ifdef USE_QDA
+		if (delta || transaction < resume_from) {
+			ret = qda_dfu_unchanged(dif->dev_handle, transaction,
+						buf, chunk_size);
+			if (ret < 0) {
+				warnx("Error reading device block CRCs");
+				goto out;
+			}
+			if (ret) {
+				transaction++;
+				bytes_sent += chunk_size;
+				skipped += chunk_size;
+				buf += chunk_size;
+				dfu_progress_bar("Download", bytes_sent,
+						 bytes_sent + bytes_left);
+				continue;
+			}
+		}
+#endif
 		ret = dfu_download(dif->dev_handle, dif->interface,
 		    chunk_size, transaction++, chunk_size ? buf : NULL);
 		if (ret < 0) {
@@ -137,7 +191,7 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 		do {
 			ret = dfu_get_status(dif, &dst);
 			if (ret < 0) {
-				errx(EX_IOERR, "Error during download get_status");
+				warnx("Error during download get_status");
 				goto out;
 			}
 
@@ -157,6 +211,15 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 			ret = -1;
 			goto out;
 		}
+		if (journal)
+			dfu_journal_update(journal, bytes_sent);
+#ifdef USE_QDA
+		ret = qda_adapt_link(dif->dev_handle);
+		if (ret < 0) {
+			warnx("Device lost while changing the link speed");
+			goto out;
+		}
+#endif
 		dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
 	}
 
@@ -164,14 +227,22 @@ int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
 	ret = dfu_download(dif->dev_handle, dif->interface,
 	    0, transaction, NULL);
 	if (ret < 0) {
-		errx(EX_IOERR, "Error sending completion packet");
+		warnx("Error sending completion packet");
 		goto out;
 	}
 
 	dfu_progress_bar("Download", bytes_sent, bytes_sent);
 
+#ifdef USE_QDA
+	/* Skipped blocks count as progress, but were not sent */
+	if (verbose)
+		printf("Sent a total of %i bytes\n", bytes_sent - skipped);
+	if (verbose && skipped)
+		printf("Skipped %i bytes already on the device\n", skipped);
+#else
 	if (verbose)
 		printf("Sent a total of %i bytes\n", bytes_sent);
+#endif
 
 get_status:
 	/* Transition to MANIFEST_SYNC state */
@@ -199,7 +270,105 @@ get_status:
 		break;
 	}
 	printf("Done!\n");
+	if (journal)
+		dfu_journal_update(journal, 0);
+
+out:
+	if (journal && ret < 0)
+		dfu_journal_flush(journal);
+#ifdef USE_QDA
+	if (verbose)
+		qda_report_stats(dif->dev_handle);
+#endif
+	return ret < 0 ? ret : bytes_sent;
+}
+
+/* Maximum number of mismatching ranges printed */
+#define VERIFY_MAX_RANGES 8
+
+/*
+ * Print the ranges of bytes that differ between two blocks.
+ */
+static void dfuload_print_mismatch(int offset, const unsigned char *expected,
+    const unsigned char *actual, int len)
+{
+	int ranges = 0;
+	int start;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (expected[i] == actual[i])
+			continue;
+		for (start = i; i < len && expected[i] != actual[i]; i++)
+			;
+		if (ranges++ == VERIFY_MAX_RANGES) {
+			printf("  ...\n");
+			break;
+		}
+		printf("  0x%08x-0x%08x differs\n", offset + start,
+		    offset + i - 1);
+	}
+}
+
+int dfuload_do_verify(struct dfu_if *dif, int xfer_size, struct dfu_file *file)
+{
+	unsigned short transaction = 0;
+	unsigned char *expected;
+	unsigned char *buf;
+	int expected_size;
+	int bytes_checked = 0;
+	int chunk_size;
+	int ret = 0;
+	int rc;
+
+	printf("Verifying data on DFU device\n");
+
+	expected = file->firmware;
+	expected_size = file->size.total - file->size.suffix;
+	buf = dfu_malloc(xfer_size);
+
+	dfu_progress_bar("Verify", 0, 1);
+	while (bytes_checked < expected_size) {
+		chunk_size = expected_size - bytes_checked;
+		if (chunk_size > xfer_size)
+			chunk_size = xfer_size;
+
+		/* Blocks are numbered in units of the requested size */
+		rc = dfu_upload(dif->dev_handle, dif->interface,
+		    xfer_size, transaction++, buf);
+		if (rc < 0) {
+			warnx("Error during verify");
+			ret = rc;
+			goto out;
+		}
+		if (rc < chunk_size) {
+			printf("\nVerify failed: device returned %i bytes at "
+			    "0x%08x, %i expected\n", rc, bytes_checked,
+			    chunk_size);
+			ret = -1;
+			goto out;
+		}
+		if (memcmp(buf, expected, chunk_size)) {
+			/* Stop at the first mismatching block */
+			printf("\nVerify failed at block %u:\n",
+			    transaction - 1);
+			dfuload_print_mismatch(bytes_checked, expected, buf,
+			    chunk_size);
+			ret = -1;
+			goto out;
+		}
+		bytes_checked += chunk_size;
+		expected += chunk_size;
+		dfu_progress_bar("Verify", bytes_checked, expected_size);
+	}
 
 out:
-	return bytes_sent;
+	/* Leave the upload, whether or not the device reached its end */
+	if (dfu_abort(dif->dev_handle, dif->interface) < 0)
+		warnx("can't abort upload after verify");
+	free(buf);
+	if (verbose)
+		printf("Verified %i of %i bytes\n", bytes_checked,
+		    expected_size);
+	return ret;
 }
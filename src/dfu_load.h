@@ -2,6 +2,10 @@
 #define DFU_LOAD_H
 
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size, int expected_size, int fd);
-int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file);
+struct dfu_journal;
+
+int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
+    struct dfu_journal *journal);
+int dfuload_do_verify(struct dfu_if *dif, int xfer_size, struct dfu_file *file);
 
 #endif /* DFU_LOAD_H */
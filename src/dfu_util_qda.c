@@ -26,6 +26,32 @@
 #include <fcntl.h>
 #include "qda.h"
 #include "xmodem.h"
+#include "serial_io.h"
+#include "transport.h"
+#include "dfu_util_qda.h"
+
+/* How long the device tries a new speed, in milliseconds */
+#define SPEED_TRIAL_MS (1000)
+
+/* Bound of the XMODEM timeouts while probing a new speed, in milliseconds */
+#define SPEED_PROBE_MS (50)
+
+/*
+ * Link adaptation: window (in frames) over which errors are counted, error
+ * rate (in percent) moving the link one speed down, and clean windows needed
+ * before moving it up again (initially / at most)
+ */
+#define LINK_WINDOW (64)
+#define LINK_MAX_ERROR_PCT (10)
+#define LINK_CLEAN_WINDOWS (4)
+#define LINK_MAX_CLEAN_WINDOWS (64)
+
+/* Standard speeds the link is moved to, fastest first */
+static const int link_speeds[] = {
+	3000000, 2000000, 1500000, 1000000, 921600, 460800, 230400,
+};
+
+#define N_LINK_SPEEDS (sizeof(link_speeds) / sizeof(link_speeds[0]))
 
 #define DEBUG_MSG (0)
 
@@ -36,20 +62,392 @@
 #endif
 
 /* called from QDA */
-int dfu_util_qda_send(uint8_t *data, size_t len)
+int dfu_util_qda_send(void *ctx, uint8_t *data, size_t len)
 {
+	dfu_util_qda_session_t *session = ctx;
+
 	printd("QDA send:    (%d)\n", len);
-	return xmodem_transmit_package(data, len);
+	return xmodem_transmit_package(&session->xmodem, data, len);
 }
 
 /* called from QDA */
-size_t dfu_util_qda_receive(uint8_t *data, size_t len)
+size_t dfu_util_qda_receive(void *ctx, uint8_t *data, size_t len)
 {
+	dfu_util_qda_session_t *session = ctx;
 	int ret;
 
 	printd("QDA receive: (%d)\n", len);
-	ret = xmodem_receive_package(data, len);
+	ret = xmodem_receive_package(&session->xmodem, data, len);
 
 	return (ret==-1)?0:ret;
 }
 
+/* called from QDA */
+int dfu_util_qda_sendv(void *ctx, const qda_iov_t *iov, int iovcnt)
+{
+	dfu_util_qda_session_t *session = ctx;
+	xmodem_iovec_t vec[XMODEM_MAX_IOV];
+	int i;
+
+	if (iovcnt > XMODEM_MAX_IOV) {
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].base = iov[i].base;
+		vec[i].len = iov[i].len;
+	}
+	printd("QDA sendv:   (%d segments)\n", iovcnt);
+	return xmodem_transmit_iov(&session->xmodem, vec, iovcnt);
+}
+
+/* called from QDA */
+size_t dfu_util_qda_receivev(void *ctx, const qda_iov_t *iov, int iovcnt)
+{
+	dfu_util_qda_session_t *session = ctx;
+	xmodem_iovec_t vec[XMODEM_MAX_IOV];
+	int ret;
+	int i;
+
+	if (iovcnt > XMODEM_MAX_IOV) {
+		return 0;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].base = iov[i].base;
+		vec[i].len = iov[i].len;
+	}
+	printd("QDA receivev: (%d segments)\n", iovcnt);
+	ret = xmodem_receive_iov(&session->xmodem, vec, iovcnt);
+
+	return (ret==-1)?0:ret;
+}
+
+/* called from QDA */
+int dfu_util_qda_detach(void *ctx)
+{
+	dfu_util_qda_session_t *session = ctx;
+	int ret;
+
+	if ((session->speed != session->open_speed) &&
+	    !session->tr->set_speed(session->tr_ctx, session->open_speed)) {
+		session->speed = session->open_speed;
+	}
+	ret = session->tr->detach(session->tr_ctx);
+	/* Whatever the device was sending is lost with the detach */
+	xmodem_flush(&session->xmodem);
+	/* Windowed mode waits for the device to advertise it again */
+	xmodem_set_window(&session->xmodem, 1);
+
+	return ret;
+}
+
+/* called from QDA */
+void dfu_util_qda_report_stats(void *ctx)
+{
+	dfu_util_qda_session_t *session = ctx;
+	xmodem_stats_t xs;
+	transport_stats_t ts;
+	fault_stats_t fs;
+	unsigned long data;
+	unsigned long kib;
+	unsigned long ms;
+
+	xmodem_get_stats(&session->xmodem, &xs);
+	session->tr->get_stats(session->tr_ctx, &ts);
+	printf("XMODEM: %lu frames sent (%lu retransmissions, %lu NAKs "
+	       "received, %lu padding bytes)\n",
+	       xs.tx_frames, xs.retransmits, xs.naks_received, xs.pad_bytes);
+	printf("XMODEM: %lu frames received (%lu duplicates, %lu corrupted, "
+	       "%lu NAKs sent, %lu junk bytes dropped), %lu timeouts\n",
+	       xs.rx_frames, xs.duplicates, xs.crc_errors, xs.naks_sent,
+	       xs.junk_bytes, xs.timeouts);
+	printf("XMODEM: ACK round-trip time %lu us\n", xs.srtt_us);
+	kib = (ts.tx_bytes + ts.rx_bytes + 1023) / 1024;
+	printf("%s I/O: %lu bytes sent, %lu bytes received, "
+	       "%lu syscalls (%lu per KiB), link time %lu ms\n",
+	       session->tr->name, ts.tx_bytes, ts.rx_bytes, ts.syscalls,
+	       kib ? ts.syscalls / kib : 0,
+	       (unsigned long)(ts.link_time_us / 1000));
+	if (session->tr == &fault_transport) {
+		fault_transport_get_stats(session->tr_ctx, &fs);
+		printf("Faults: %lu bits flipped, %lu bytes dropped, "
+		       "%lu junk bytes, %lu truncations, %lu delays\n",
+		       fs.flipped, fs.dropped, fs.junk, fs.truncated,
+		       fs.delayed);
+	}
+	if (session->max_speed) {
+		printf("Link speed: %d baud (%lu steps down, %lu steps up)\n",
+		       session->speed, session->downshifts,
+		       session->upshifts);
+	}
+	data = qda_get_data_bytes(&session->qda);
+	ms = ts.link_time_us / 1000;
+	printf("Goodput: %lu bytes in %lu ms (%lu bytes/s)\n", data, ms,
+	       ms ? (unsigned long)((uint64_t)data * 1000 / ms) : 0);
+	if (qda_get_fill_bytes(&session->qda)) {
+		printf("Filled: %lu erased bytes written without their data\n",
+		       qda_get_fill_bytes(&session->qda));
+	}
+}
+
+int dfu_util_qda_open(dfu_util_qda_session_t *session, const char *path,
+		      int speed)
+{
+	size_t len = strlen(LOOPBACK_PATH);
+
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!strncmp(path, LOOPBACK_PATH, len) &&
+	    ((path[len] == '\0') || (path[len] == ':'))) {
+		session->tr = &loopback_transport;
+	} else {
+		session->tr = &serial_io_transport;
+	}
+	session->tr_ctx = session->tr->open(path, speed);
+	if (!session->tr_ctx) {
+		return -1;
+	}
+	session->speed = speed;
+	session->open_speed = speed;
+	session->max_speed = 0;
+	session->downshifts = 0;
+	session->upshifts = 0;
+	session->window = 1;
+	xmodem_init(&session->xmodem, session->tr, session->tr_ctx);
+
+	session->conf.ctx = session;
+	session->conf.send = dfu_util_qda_send;
+	session->conf.receive = dfu_util_qda_receive;
+	session->conf.sendv = dfu_util_qda_sendv;
+	session->conf.receivev = dfu_util_qda_receivev;
+	session->conf.detach = dfu_util_qda_detach;
+	session->conf.report_stats = dfu_util_qda_report_stats;
+	session->conf.adapt = dfu_util_qda_adapt;
+	qda_init(&session->qda, &session->conf);
+
+	return 0;
+}
+
+int dfu_util_qda_inject_faults(dfu_util_qda_session_t *session,
+			       const char *spec)
+{
+	void *ctx;
+
+	ctx = fault_transport_wrap(session->tr, session->tr_ctx, spec);
+	if (!ctx) {
+		return -1;
+	}
+	session->tr = &fault_transport;
+	session->tr_ctx = ctx;
+	xmodem_init(&session->xmodem, session->tr, session->tr_ctx);
+
+	return 0;
+}
+
+int dfu_util_qda_negotiate(dfu_util_qda_session_t *session)
+{
+	uint32_t caps;
+
+	if (qda_get_caps(&session->qda, &caps) < 0) {
+		return -1;
+	}
+	xmodem_set_short(&session->xmodem, !!(caps & QDA_CAP_SHORT_FRAMES));
+	xmodem_set_turnaround(&session->xmodem, !!(caps & QDA_CAP_TURNAROUND));
+	xmodem_set_window(&session->xmodem,
+			  (caps & QDA_CAP_WINDOW) ? session->window : 1);
+
+	return 0;
+}
+
+int dfu_util_qda_set_speed(dfu_util_qda_session_t *session, int speed)
+{
+	uint32_t caps;
+	int ret;
+
+	if (qda_set_baud(&session->qda, speed, SPEED_TRIAL_MS) < 0) {
+		return 1;
+	}
+	if (!session->tr->set_speed(session->tr_ctx, speed)) {
+		/* Any request at the new speed confirms it to the device */
+		xmodem_flush(&session->xmodem);
+		xmodem_set_max_timeout(&session->xmodem, SPEED_PROBE_MS);
+		ret = qda_get_caps(&session->qda, &caps);
+		xmodem_set_max_timeout(&session->xmodem, 0);
+		if (!ret) {
+			session->speed = speed;
+			return 0;
+		}
+		printd("QDA: no answer at %d baud\n", speed);
+		session->tr->set_speed(session->tr_ctx, session->speed);
+	}
+	/*
+	 * The device gives up on the new speed at the end of the trial and
+	 * sends a 'C' at the previous one: the request waits for it.
+	 */
+	xmodem_flush(&session->xmodem);
+	if (qda_get_caps(&session->qda, &caps) < 0) {
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Get the number of frames sent and received, and of errors among them.
+ */
+static void dfu_util_qda_get_errors(dfu_util_qda_session_t *session,
+				    unsigned long *frames,
+				    unsigned long *errors)
+{
+	xmodem_stats_t xs;
+
+	xmodem_get_stats(&session->xmodem, &xs);
+	*frames = xs.tx_frames + xs.rx_frames;
+	*errors = xs.crc_errors + xs.naks_received + xs.timeouts;
+}
+
+/*
+ * Lower the maximum speed below a speed the device did not answer at, so that
+ * it is not probed again (not below the current speed).
+ */
+static void dfu_util_qda_cap_speed(dfu_util_qda_session_t *session,
+				   int failed)
+{
+	int cap = session->speed;
+	size_t i;
+
+	for (i = 0; i < N_LINK_SPEEDS; i++) {
+		if ((link_speeds[i] < failed) && (link_speeds[i] > cap)) {
+			cap = link_speeds[i];
+		}
+	}
+	if (cap < session->max_speed) {
+		session->max_speed = cap;
+	}
+}
+
+int dfu_util_qda_upshift(dfu_util_qda_session_t *session, int max_speed)
+{
+	size_t i;
+	int ret;
+
+	if (!(session->qda.caps & QDA_CAP_SET_BAUD)) {
+		return session->speed;
+	}
+	session->max_speed = max_speed;
+	session->clean_windows = 0;
+	session->clean_needed = LINK_CLEAN_WINDOWS;
+	ret = 1;
+	if (max_speed > session->speed) {
+		ret = dfu_util_qda_set_speed(session, max_speed);
+		if (ret > 0) {
+			dfu_util_qda_cap_speed(session, max_speed);
+		}
+	}
+	for (i = 0; (ret > 0) && (i < N_LINK_SPEEDS); i++) {
+		if ((link_speeds[i] <= session->max_speed) &&
+		    (link_speeds[i] > session->speed)) {
+			ret = dfu_util_qda_set_speed(session, link_speeds[i]);
+			if (ret > 0) {
+				dfu_util_qda_cap_speed(session,
+						       link_speeds[i]);
+			}
+		}
+	}
+	dfu_util_qda_get_errors(session, &session->mon_frames,
+				&session->mon_errors);
+
+	return (ret < 0) ? -1 : session->speed;
+}
+
+/*
+ * Get the speed next to the current one, down (not below the speed the link
+ * was opened with) or up (not above the maximum speed).
+ */
+static int dfu_util_qda_next_speed(const dfu_util_qda_session_t *session,
+				   int up)
+{
+	int next = up ? session->max_speed : session->open_speed;
+	size_t i;
+
+	for (i = 0; i < N_LINK_SPEEDS; i++) {
+		if (up && (link_speeds[i] > session->speed) &&
+		    (link_speeds[i] < next)) {
+			next = link_speeds[i];
+		} else if (!up && (link_speeds[i] < session->speed) &&
+			   (link_speeds[i] > next)) {
+			next = link_speeds[i];
+		}
+	}
+
+	return next;
+}
+
+/* called from QDA */
+int dfu_util_qda_adapt(void *ctx)
+{
+	dfu_util_qda_session_t *session = ctx;
+	unsigned long frames;
+	unsigned long errors;
+	int speed;
+	int up;
+	int ret;
+
+	if (!session->max_speed || !(session->qda.caps & QDA_CAP_SET_BAUD)) {
+		return 0;
+	}
+	dfu_util_qda_get_errors(session, &frames, &errors);
+	frames -= session->mon_frames;
+	errors -= session->mon_errors;
+	if (frames < LINK_WINDOW) {
+		return 0;
+	}
+	session->mon_frames += frames;
+	session->mon_errors += errors;
+	if (errors * 100 > frames * LINK_MAX_ERROR_PCT) {
+		session->clean_windows = 0;
+		up = 0;
+		speed = dfu_util_qda_next_speed(session, 0);
+		if (speed >= session->speed) {
+			return 0;
+		}
+		if (session->clean_needed < LINK_MAX_CLEAN_WINDOWS) {
+			session->clean_needed *= 2;
+		}
+	} else if (!errors &&
+		   (++session->clean_windows >= session->clean_needed)) {
+		session->clean_windows = 0;
+		up = 1;
+		speed = dfu_util_qda_next_speed(session, 1);
+		if (speed <= session->speed) {
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+	ret = dfu_util_qda_set_speed(session, speed);
+	if (!ret && up) {
+		session->upshifts++;
+	} else if (!ret) {
+		session->downshifts++;
+	} else if ((ret > 0) && up) {
+		/* Do not pay for the probe again every few windows */
+		dfu_util_qda_cap_speed(session, speed);
+	}
+	/* The errors of the switch itself are not held against the link */
+	dfu_util_qda_get_errors(session, &session->mon_frames,
+				&session->mon_errors);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+int dfu_util_qda_close(dfu_util_qda_session_t *session)
+{
+	int ret;
+
+	ret = session->tr->close(session->tr_ctx);
+	session->tr_ctx = NULL;
+
+	return ret;
+}
@@ -20,6 +20,9 @@
 #define DFU_UTIL_QDA_H
 
 #include <stdint.h>
+#include "qda.h"
+#include "transport.h"
+#include "xmodem.h"
 
 enum mode {
 	MODE_NONE,
@@ -30,11 +33,142 @@ enum mode {
 	MODE_DOWNLOAD
 };
 
+/**
+ * A session with a QDA device.
+ *
+ * It bundles the state of all the layers of the link (transport, XMODEM,
+ * QDA), so that each device is driven independently.
+ */
+typedef struct {
+	/** The transport: serial port or loopback. */
+	const transport_t *tr;
+	/** The context of the transport. */
+	void *tr_ctx;
+	/** The speed of the link, and the one it was opened with. */
+	int speed;
+	int open_speed;
+	/** The highest speed allowed (see dfu_util_qda_upshift()), or 0. */
+	int max_speed;
+	/** Error monitoring: XMODEM counters at the start of the window. */
+	unsigned long mon_frames;
+	unsigned long mon_errors;
+	/** Clean windows seen, and needed before going faster again. */
+	int clean_windows;
+	int clean_needed;
+	/** Number of speed changes made by dfu_util_qda_adapt(). */
+	unsigned long downshifts;
+	unsigned long upshifts;
+	/** The XMODEM transmit window requested, used if QDA_CAP_WINDOW. */
+	unsigned int window;
+	/** The XMODEM session running on the transport. */
+	xmodem_t xmodem;
+	/** The QDA configuration, binding QDA to the XMODEM session. */
+	qda_conf_t conf;
+	/** The QDA session; pass it to the qda_*() functions. */
+	qda_t qda;
+} dfu_util_qda_session_t;
+
+/**
+ * Open a session with a QDA device.
+ *
+ * The loopback transport is used if the path starts with LOOPBACK_PATH, the
+ * serial one otherwise.
+ *
+ * @param[out] session The session to open.
+ * @param[in] path Path to serial interface (or loopback description).
+ * @param[in] speed Serial speed.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (Check errno)
+ */
+int dfu_util_qda_open(dfu_util_qda_session_t *session, const char *path,
+		      int speed);
+
+/**
+ * Close a session with a QDA device.
+ *
+ * @param[in] session The session to close.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (Check errno)
+ */
+int dfu_util_qda_close(dfu_util_qda_session_t *session);
+
+/**
+ * Inject faults into the link of a session.
+ *
+ * The transport of the session is wrapped into the fault transport. This must
+ * be done right after dfu_util_qda_open(), before any XMODEM setting.
+ *
+ * @param[in] session The session.
+ * @param[in] spec    The fault specification (see fault_transport_wrap()).
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (Check errno)
+ */
+int dfu_util_qda_inject_faults(dfu_util_qda_session_t *session,
+			       const char *spec);
+
+/**
+ * Query the protocol extensions supported by the device and enable them.
+ *
+ * Extensions not advertised by the device are left disabled, so that legacy
+ * devices keep working.
+ *
+ * @param[in] session The session.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error
+ */
+int dfu_util_qda_negotiate(dfu_util_qda_session_t *session);
+
+/**
+ * Move the link to a new speed.
+ *
+ * The device is asked to switch (QDA_PKT_SET_BAUD_REQ), then the host, and
+ * the link is probed with a short timeout. If the probe fails, both sides go
+ * back to the previous speed.
+ *
+ * @param[in] session The session.
+ * @param[in] speed   The new speed, in baud.
+ *
+ * @return Status
+ * @retval 0  The link runs at the new speed.
+ * @retval 1  The link still runs at the previous speed (e.g., the device
+ * 	      does not support the new one).
+ * @retval -1 Error: the device does not answer anymore.
+ */
+int dfu_util_qda_set_speed(dfu_util_qda_session_t *session, int speed);
+
+/**
+ * Move the link to the fastest speed it supports, up to a maximum.
+ *
+ * The maximum is tried first, then the standard rates below it, fastest
+ * first. Nothing is done if the device does not support QDA_CAP_SET_BAUD
+ * (see dfu_util_qda_negotiate()).
+ *
+ * The maximum speed is also the bound of dfu_util_qda_adapt(). It is lowered
+ * below any speed the device does not answer at, here or when
+ * dfu_util_qda_adapt() tries to go faster.
+ *
+ * @param[in] session   The session.
+ * @param[in] max_speed The maximum speed, in baud.
+ *
+ * @return The speed of the link, or -1 if the device does not answer
+ * 	   anymore.
+ */
+int dfu_util_qda_upshift(dfu_util_qda_session_t *session, int max_speed);
+
 /**
  * Send a QDA message using XMODEM.
  *
  * This function is called by QDA as a send callback.
  *
+ * @param[in] ctx The session (dfu_util_qda_session_t).
  * @param[in] data Data to be sent.
  * @param[in] len Length of data to be sent.
  *
@@ -42,18 +176,95 @@ enum mode {
  * @retval 0 Success
  * @retval <0 Error (Forwarded error code from XMODEM)
  */
-int dfu_util_qda_send(uint8_t *data, size_t len);
+int dfu_util_qda_send(void *ctx, uint8_t *data, size_t len);
 
 /**
  * Receive a QDA message using XMODEM.
  *
  * This function is called by QDA as a receive callback.
  *
+ * @param[in] ctx The session (dfu_util_qda_session_t).
  * @param[out] data Data buffer for received bytes.
  * @param[in] len Maximum allocated bytes that can be received.
  *
  * @return Length of received data.
  */
-size_t dfu_util_qda_receive(uint8_t *data, size_t len);
+size_t dfu_util_qda_receive(void *ctx, uint8_t *data, size_t len);
+
+/**
+ * Send a QDA message made of several segments using XMODEM.
+ *
+ * This function is called by QDA as a scatter-gather send callback.
+ *
+ * @param[in] ctx    The session (dfu_util_qda_session_t).
+ * @param[in] iov    The segments of the message.
+ * @param[in] iovcnt The number of segments.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval <0 Error (Forwarded error code from XMODEM)
+ */
+int dfu_util_qda_sendv(void *ctx, const qda_iov_t *iov, int iovcnt);
+
+/**
+ * Receive a QDA message into several segments using XMODEM.
+ *
+ * This function is called by QDA as a scatter-gather receive callback.
+ *
+ * @param[in] ctx    The session (dfu_util_qda_session_t).
+ * @param[in] iov    The segments where to store the message.
+ * @param[in] iovcnt The number of segments.
+ *
+ * @return Length of received data.
+ */
+size_t dfu_util_qda_receivev(void *ctx, const qda_iov_t *iov, int iovcnt);
+
+/**
+ * Print the statistics of the link (XMODEM and transport).
+ *
+ * This function is called by QDA as a statistics report callback.
+ *
+ * @param[in] ctx The session (dfu_util_qda_session_t).
+ */
+void dfu_util_qda_report_stats(void *ctx);
+
+/**
+ * Adapt the speed of the link to its error rate.
+ *
+ * The XMODEM errors (corrupted frames, NAKs, timeouts) are counted over
+ * windows of frames. After a window with too many of them, the link moves to
+ * the next standard speed down, not below the speed it was opened with.
+ * After enough windows without any, it moves one speed up again, not above
+ * the maximum speed; every step down doubles the number of windows needed.
+ *
+ * Nothing is done unless dfu_util_qda_upshift() has been called and the
+ * device supports QDA_CAP_SET_BAUD.
+ *
+ * This function is called by QDA as a link adaptation callback, between
+ * blocks.
+ *
+ * @param[in] ctx The session (dfu_util_qda_session_t).
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (the device does not answer anymore)
+ */
+int dfu_util_qda_adapt(void *ctx);
+
+/**
+ * Detach a QDA device (using the RTS line on a serial port).
+ *
+ * The device restarts at its initial speed, so the link goes back to the
+ * speed it was opened with.
+ *
+ * This function is called by QDA as a detach callback.
+ *
+ * @param[in] ctx The session (dfu_util_qda_session_t).
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error
+ */
+int dfu_util_qda_detach(void *ctx);
 
 #endif /* DFU_UTIL_QDA_H */
@@ -47,6 +47,7 @@
 #include "usb_dfu.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
+#include "dfu_journal.h"
 #ifndef USE_QDA
 #include "dfu_util.h"
 #include "dfuse.h"
@@ -57,6 +58,11 @@
 #include <usbpath.h>
 #endif
 
+#ifdef USE_QDA
+/* Maximum number of times an interrupted download is resumed in a run */
+#define MAX_RESUMES 5
+#endif
+
 int verbose = 0;
 
 struct dfu_if *dfu_root = NULL;
@@ -194,14 +200,41 @@ static void help(void)
 	    "  -V --version\t\t\tPrint the version number\n"
 	    "  -v --verbose\t\t\tPrint verbose debug statements\n");
     fprintf(stderr,
-	    "  -p --path <to serial device>\tSpecify path to UART\n"
-	    "  -s --speed <baud rate>\tSpecify UART baud rate [default: 115200]\n"
+	    "  -p --path <to serial device>\tSpecify path to UART, or \"loopback[:<options>]\"\n"
+	    "\t\t\t\tto use an in-process device model\n"
+	    "  -s --speed <baud rate>\tSpecify UART baud rate [default: 115200];\n"
+	    "\t\t\t\tnon-standard rates are supported on Linux\n"
+	    "  -b --max-speed <baud rate>\tSwitch to the fastest rate up to <baud rate>\n"
+	    "\t\t\t\tthat the device and the link support, once\n"
+	    "\t\t\t\tconnected (if supported by the device)\n"
+	    "  -C --rtscts\t\t\tUse RTS/CTS hardware flow control\n"
+	    "  -L --low-latency\t\tUse the low-latency mode of the serial driver\n"
+	    "\t\t\t\t(e.g., 1 ms latency timer on USB-serial adapters)\n"
+	    "  -k --xmodem-1k\t\tUse XMODEM-1K (1024 bytes) frames\n"
+	    "  -w --window <frames>\t\tSend up to <frames> XMODEM frames before\n"
+	    "\t\t\t\twaiting for an ACK [default: 1] (if supported\n"
+	    "\t\t\t\tby the device)\n"
+	    "  -z --compress\t\t\tCompress downloaded blocks (if supported by\n"
+	    "\t\t\t\tthe device)\n"
+	    "  -u --update\t\t\tOnly download the blocks that differ from\n"
+	    "\t\t\t\tthe device content (if supported by the\n"
+	    "\t\t\t\tdevice)\n"
+	    "  -F --fill <value>\t\tDo not send the data of blocks filled with\n"
+	    "\t\t\t\tthe erased flash value, e.g. 0xff (if\n"
+	    "\t\t\t\tsupported by the device)\n"
+	    "  -f --faults <spec>\t\tInject line errors (e.g. \"seed=1,flip=1e-4,\n"
+	    "\t\t\t\tdrop=1e-4,junk=0.01,trunc=0.01,delay=0.01\")\n"
 	    "  -t --transfer-size <size>\tOverride DFU transfer block size.\n"
 	    "  -a --alt <alt>\t\tSpecify the Altsetting of the DFU Interface\n"
 	    "\t\t\t\tby name or by number\n");
     fprintf(stderr,
 	    "  -U --upload <file>\t\tRead firmware from device into <file>\n"
 	    "  -D --download <file>\t\tWrite firmware from <file> into device\n"
+	    "  -r --resume\t\t\tResume an interrupted download (if supported\n"
+	    "\t\t\t\tby the device), within this run or from a\n"
+	    "\t\t\t\tprevious one\n"
+	    "  -y --verify\t\t\tRead the firmware back after download and\n"
+	    "\t\t\t\tcompare it with <file>\n"
 	    "  -R --reset\t\t\tReset device once we're finished\n");
 	exit(EX_USAGE);
 }
@@ -227,11 +260,22 @@ static struct option opts[] = {
 	{ "upload", 1, 0, 'U' },
 	{ "download", 1, 0, 'D' },
 	{ "reset", 0, 0, 'R' },
+	{ "resume", 0, 0, 'r' },
+	{ "verify", 0, 0, 'y' },
 	{ "speed", 1, 0, 's'},
+	{ "max-speed", 1, 0, 'b'},
+	{ "rtscts", 0, 0, 'C'},
+	{ "low-latency", 0, 0, 'L'},
+	{ "xmodem-1k", 0, 0, 'k'},
+	{ "window", 1, 0, 'w'},
+	{ "compress", 0, 0, 'z'},
+	{ "update", 0, 0, 'u'},
+	{ "fill", 1, 0, 'F'},
+	{ "faults", 1, 0, 'f'},
 	{ 0, 0, 0, 0 }
 };
 
-const char * short_opts = "hVvp:a:t:U:D:Rs:";
+const char * short_opts = "hVvp:a:t:U:D:Rrys:b:CLkw:zuF:f:";
 
 #else /* USE_QDA */
 
@@ -311,7 +355,21 @@ int main(int argc, char **argv)
 	struct dfu_status status;
 #ifdef USE_QDA
 	unsigned int transfer_speed = 115200;
+	int max_speed = 0;
+	int rtscts = 0;
+	int low_latency = 0;
 	char * serial_device_path = NULL;
+	dfu_util_qda_session_t session;
+	int xmodem_1k = 0;
+	unsigned int xmodem_window = 1;
+	int compress = 0;
+	int erased = -1;
+	int delta = 0;
+	int verify = 0;
+	int resume = 0;
+	int resumes = 0;
+	struct dfu_journal journal;
+	const char *fault_spec = NULL;
 #else
 	libusb_context *ctx;
 #endif
@@ -424,6 +482,51 @@ int main(int argc, char **argv)
 			dfuse_options = optarg;
 #endif
 			break;
+#ifdef USE_QDA
+		case 'b':
+			max_speed = atoi(optarg);
+			if (max_speed <= 0)
+				errx(EX_USAGE, "Invalid maximum speed '%s'",
+				     optarg);
+			break;
+		case 'C':
+			rtscts = 1;
+			break;
+		case 'L':
+			low_latency = 1;
+			break;
+		case 'k':
+			xmodem_1k = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 'y':
+			verify = 1;
+			break;
+		case 'u':
+			delta = 1;
+			break;
+		case 'F':
+			erased = strtol(optarg, &end, 0);
+			if ((*end != '\0') || (erased < 0) || (erased > 0xff))
+				errx(EX_USAGE, "Erased value must be between "
+				     "0 and 0xff");
+			break;
+		case 'f':
+			fault_spec = optarg;
+			break;
+		case 'w':
+			xmodem_window = atoi(optarg);
+			if ((xmodem_window < 1) ||
+			    (xmodem_window > XMODEM_MAX_WINDOW))
+				errx(EX_USAGE, "Window must be between 1 and %d",
+				     XMODEM_MAX_WINDOW);
+			break;
+#endif
 		default:
 			help();
 			break;
@@ -464,30 +567,78 @@ int main(int argc, char **argv)
 	dfu_root = (struct dfu_if *)&root;
 	dfu_root->altsetting = match_iface_alt_index;
 
-	qda_conf_t qda_conf;
-	qda_conf.send = dfu_util_qda_send;
-	qda_conf.receive = dfu_util_qda_receive;
-	qda_conf.detach = serial_detach;
-	qda_init(&qda_conf);
-
 	/* open interface */
-	ret = serial_io_open(serial_device_path,
-						 transfer_speed);
+	ret = dfu_util_qda_open(&session, serial_device_path,
+				transfer_speed);
 
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot open serial device.");
 	}
+	if (fault_spec && (dfu_util_qda_inject_faults(&session, fault_spec) < 0)) {
+		errx(EX_USAGE, "Invalid fault specification '%s'", fault_spec);
+	}
+	if (rtscts && (session.tr->set_flow_control(session.tr_ctx, 1) < 0)) {
+		errx(EX_IOERR, "Cannot enable RTS/CTS flow control.");
+	}
+	if (low_latency &&
+	    (session.tr->set_low_latency(session.tr_ctx, 1) < 0)) {
+		warn("Cannot enable the low-latency mode");
+	}
+	xmodem_set_1k(&session.xmodem, xmodem_1k);
+	session.window = xmodem_window;
+	dfu_root->dev_handle = &session.qda;
+	if (resume && mode == MODE_DOWNLOAD && serial_device_path) {
+		dfu_journal_open(&journal, serial_device_path, file.firmware,
+				 file.size.total - file.size.suffix);
+	}
 
+detach:
 	printf("Detaching device into DFU mode.\n");
-	if (qda_dfu_detach() < 0) {
+	if (qda_dfu_detach(dfu_root->dev_handle) < 0) {
 		errx(EX_IOERR, "can't detach device.");
 	}
 
 
 	printf("Determining device capabilities.\n");
-	if (qda_get_dfu_desc(dfu_root) < 0) {
+	if (dfu_util_qda_negotiate(&session) < 0) {
 		errx(EX_IOERR, "can't read device capabilities.");
 	}
+	if (verbose) {
+		printf("QDA extensions: 0x%08x\n", session.qda.caps);
+	}
+	if (compress && !(session.qda.caps & QDA_CAP_LZ_DNLOAD)) {
+		printf("Device does not support compression, "
+		       "sending raw data.\n");
+	}
+	qda_set_compression(&session.qda, compress);
+	if ((erased >= 0) && !(session.qda.caps & QDA_CAP_DNLOAD_FILL)) {
+		printf("Device does not support fill requests, "
+		       "sending erased blocks.\n");
+	}
+	qda_set_erased_value(&session.qda, erased);
+	if (delta && !(session.qda.caps & QDA_CAP_DELTA_DNLOAD)) {
+		printf("Device does not support delta downloads, "
+		       "sending the whole image.\n");
+	}
+	qda_set_delta(&session.qda, delta);
+	if ((xmodem_window > 1) && !(session.qda.caps & QDA_CAP_WINDOW)) {
+		printf("Device does not support windowed transfers, "
+		       "waiting for each ACK.\n");
+	}
+	if (qda_get_dfu_desc(dfu_root->dev_handle, dfu_root) < 0) {
+		errx(EX_IOERR, "can't read device capabilities.");
+	}
+	/* The handshake is done at the initial speed: switch now */
+	if (max_speed && !(session.qda.caps & QDA_CAP_SET_BAUD)) {
+		printf("Device does not support speed changes, "
+		       "staying at %d baud.\n", session.speed);
+	} else if (max_speed > session.speed) {
+		ret = dfu_util_qda_upshift(&session, max_speed);
+		if (ret < 0) {
+			errx(EX_IOERR, "device lost while changing speed.");
+		}
+		printf("Link speed: %d baud\n", ret);
+	}
 
 	runtime_vendor = dfu_root->vendor;
 	runtime_product = dfu_root->product;
@@ -792,8 +943,24 @@ status_again:
 #endif
 				exit(1);
 		} else {
-			if (dfuload_do_dnload(dfu_root, transfer_size, &file) < 0)
+#ifdef USE_QDA
+			if (dfuload_do_dnload(dfu_root, transfer_size, &file,
+			    resume ? &journal : NULL) < 0) {
+				if (!resume || ++resumes > MAX_RESUMES)
+					exit(1);
+				/* Sync again with the device, then resume */
+				printf("Download interrupted, resuming (attempt "
+				    "%d of %d)\n", resumes, MAX_RESUMES);
+				goto detach;
+			}
+			if (verify && dfuload_do_verify(dfu_root,
+			    transfer_size, &file) < 0)
+				exit(1);
+#else
+			if (dfuload_do_dnload(dfu_root, transfer_size, &file,
+			    NULL) < 0)
 				exit(1);
+#endif
 	 	}
 		break;
 	case MODE_DETACH:
@@ -824,7 +991,7 @@ status_again:
 	}
 
 #ifdef USE_QDA
-	serial_io_close();
+	dfu_util_qda_close(&session);
 #else
 	libusb_close(dfu_root->dev_handle);
 	dfu_root->dev_handle = NULL;
@@ -0,0 +1,392 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "transport.h"
+
+/* Maximum number of junk bytes inserted at once */
+#define FAULT_JUNK_MAX (32)
+
+/* Size of the transmit buffer: a full XMODEM-1K frame plus junk */
+#define FAULT_TX_SIZE (2048)
+
+/* Size of the receive queue */
+#define FAULT_RX_SIZE (8192)
+
+/* Default delay of a delayed read, in milliseconds */
+#define FAULT_DELAY_MS (100)
+
+/*
+ * A link with fault injection.
+ */
+typedef struct {
+	/* The wrapped transport */
+	const transport_t *tr;
+	void *tr_ctx;
+	/* Fault rates: per byte for flips / drops, per chunk otherwise */
+	double flip;
+	double drop;
+	double junk;
+	double trunc;
+	double delay;
+	uint32_t delay_us;
+	/* State of the random generator (xorshift32) */
+	uint32_t rnd;
+	/* Receive timeout in milliseconds; set by fault_set_deadline() */
+	int rx_timeout_ms;
+	/* Received bytes not delivered yet, and when they can be delivered */
+	uint8_t rx_buf[FAULT_RX_SIZE];
+	size_t rx_len;
+	uint64_t rx_release;
+	/* Transmit buffer */
+	uint8_t tx_buf[FAULT_TX_SIZE];
+	fault_stats_t stats;
+} fault_t;
+
+/*
+ * Get the next pseudo-random number (xorshift32).
+ */
+static uint32_t fault_rand(fault_t *f)
+{
+	f->rnd ^= f->rnd << 13;
+	f->rnd ^= f->rnd >> 17;
+	f->rnd ^= f->rnd << 5;
+
+	return f->rnd;
+}
+
+/*
+ * Decide whether a fault with the given probability happens.
+ */
+static int fault_hit(fault_t *f, double rate)
+{
+	return (rate > 0) && ((fault_rand(f) / 4294967296.0) < rate);
+}
+
+/*
+ * Inject faults into a chunk of bytes.
+ *
+ * @param[in]     f   The link.
+ * @param[in,out] buf The bytes; there must be room for FAULT_JUNK_MAX more.
+ * @param[in]     len The number of bytes.
+ *
+ * @return The number of bytes after fault injection.
+ */
+static size_t fault_inject(fault_t *f, uint8_t *buf, size_t len)
+{
+	size_t i;
+	size_t n;
+
+	/* Bit flips and dropped bytes */
+	for (i = 0, n = 0; i < len; i++) {
+		if (fault_hit(f, f->drop)) {
+			f->stats.dropped++;
+			continue;
+		}
+		buf[n] = buf[i];
+		if (fault_hit(f, f->flip)) {
+			buf[n] ^= 1 << (fault_rand(f) % 8);
+			f->stats.flipped++;
+		}
+		n++;
+	}
+	/* Truncation: the tail of the chunk is lost */
+	if ((n > 1) && fault_hit(f, f->trunc)) {
+		i = 1 + fault_rand(f) % (n - 1);
+		f->stats.dropped += n - i;
+		f->stats.truncated++;
+		n = i;
+	}
+	/* Garbage inserted before the chunk */
+	if (fault_hit(f, f->junk)) {
+		i = 1 + fault_rand(f) % FAULT_JUNK_MAX;
+		memmove(&buf[i], buf, n);
+		while (i--) {
+			buf[i] = fault_rand(f);
+			f->stats.junk++;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static int fault_writev(void *ctx, const transport_iovec_t *iov, int iovcnt)
+{
+	fault_t *f = ctx;
+	transport_iovec_t vec;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (len + iov[i].len > sizeof(f->tx_buf) - FAULT_JUNK_MAX) {
+			return -EINVAL;
+		}
+		memcpy(&f->tx_buf[len], iov[i].base, iov[i].len);
+		len += iov[i].len;
+	}
+	vec.base = f->tx_buf;
+	vec.len = fault_inject(f, f->tx_buf, len);
+	if (!vec.len) {
+		return 0;
+	}
+
+	return f->tr->writev(f->tr_ctx, &vec, 1);
+}
+
+/*
+ * Read the bytes available on the link.
+ *
+ * Bytes are read from the wrapped transport, damaged, and possibly held back
+ * for the delay (together with all the bytes following them).
+ */
+static int fault_read(void *ctx, uint8_t *buf, size_t len)
+{
+	fault_t *f = ctx;
+	uint64_t now = f->tr->get_time_us(f->tr_ctx);
+	uint64_t deadline = now + (uint64_t)f->rx_timeout_ms * 1000;
+	uint64_t until;
+	size_t room;
+	int retv;
+
+	for (;;) {
+		if (f->rx_len && (now >= f->rx_release)) {
+			if (len > f->rx_len) {
+				len = f->rx_len;
+			}
+			memcpy(buf, f->rx_buf, len);
+			memmove(f->rx_buf, &f->rx_buf[len], f->rx_len - len);
+			f->rx_len -= len;
+
+			return len;
+		}
+		until = (f->rx_len && (f->rx_release < deadline))
+			    ? f->rx_release
+			    : deadline;
+		if (now >= until) {
+			return -ETIMEDOUT;
+		}
+		room = sizeof(f->rx_buf) - f->rx_len - FAULT_JUNK_MAX;
+		f->tr->set_deadline(f->tr_ctx, (until - now + 999) / 1000);
+		retv = f->tr->read(f->tr_ctx, &f->rx_buf[f->rx_len],
+				   room < len ? room : len);
+		now = f->tr->get_time_us(f->tr_ctx);
+		if (retv == -ETIMEDOUT) {
+			continue;
+		}
+		if (retv < 0) {
+			return retv;
+		}
+		if (!f->rx_len && fault_hit(f, f->delay)) {
+			f->rx_release = now + f->delay_us;
+			f->stats.delayed++;
+		}
+		f->rx_len += fault_inject(f, &f->rx_buf[f->rx_len], retv);
+	}
+}
+
+static int fault_set_deadline(void *ctx, int ms)
+{
+	fault_t *f = ctx;
+
+	f->rx_timeout_ms = ms;
+
+	return 0;
+}
+
+static uint64_t fault_get_time_us(void *ctx)
+{
+	fault_t *f = ctx;
+
+	return f->tr->get_time_us(f->tr_ctx);
+}
+
+static uint32_t fault_tx_time_us(void *ctx, size_t len)
+{
+	fault_t *f = ctx;
+
+	return f->tr->tx_time_us(f->tr_ctx, len);
+}
+
+static int fault_set_speed(void *ctx, int speed)
+{
+	fault_t *f = ctx;
+
+	return f->tr->set_speed(f->tr_ctx, speed);
+}
+
+static int fault_set_flow_control(void *ctx, int enable)
+{
+	fault_t *f = ctx;
+
+	return f->tr->set_flow_control(f->tr_ctx, enable);
+}
+
+static int fault_set_low_latency(void *ctx, int enable)
+{
+	fault_t *f = ctx;
+
+	return f->tr->set_low_latency(f->tr_ctx, enable);
+}
+
+static int fault_detach(void *ctx)
+{
+	fault_t *f = ctx;
+
+	f->rx_len = 0;
+
+	return f->tr->detach(f->tr_ctx);
+}
+
+static void fault_get_stats(void *ctx, transport_stats_t *stats)
+{
+	fault_t *f = ctx;
+
+	f->tr->get_stats(f->tr_ctx, stats);
+}
+
+static int fault_close(void *ctx)
+{
+	fault_t *f = ctx;
+	int ret;
+
+	ret = f->tr->close(f->tr_ctx);
+	free(f);
+
+	return ret;
+}
+
+/*
+ * Parse a fault rate (a probability).
+ */
+static int parse_rate(const char *val, double *out)
+{
+	char *end;
+
+	*out = strtod(val, &end);
+	if ((end == val) || ((*end != ',') && (*end != '\0')) || (*out < 0) ||
+	    (*out > 1)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the fault specification.
+ */
+static int fault_parse(fault_t *f, const char *spec)
+{
+	unsigned long v;
+	char *end;
+
+	while (spec && *spec) {
+		if (!strncmp(spec, "flip=", 5)) {
+			if (parse_rate(spec + 5, &f->flip) < 0) {
+				return -1;
+			}
+		} else if (!strncmp(spec, "drop=", 5)) {
+			if (parse_rate(spec + 5, &f->drop) < 0) {
+				return -1;
+			}
+		} else if (!strncmp(spec, "junk=", 5)) {
+			if (parse_rate(spec + 5, &f->junk) < 0) {
+				return -1;
+			}
+		} else if (!strncmp(spec, "trunc=", 6)) {
+			if (parse_rate(spec + 6, &f->trunc) < 0) {
+				return -1;
+			}
+		} else if (!strncmp(spec, "delay=", 6)) {
+			if (parse_rate(spec + 6, &f->delay) < 0) {
+				return -1;
+			}
+		} else if (!strncmp(spec, "delay_ms=", 9) ||
+			   !strncmp(spec, "seed=", 5)) {
+			end = strchr(spec, '=') + 1;
+			v = strtoul(end, &end, 0);
+			if ((*end != ',') && (*end != '\0')) {
+				return -1;
+			}
+			if (spec[0] == 's') {
+				/* xorshift must not be seeded with 0 */
+				f->rnd = v ? v : 1;
+			} else {
+				f->delay_us = v * 1000;
+			}
+		} else {
+			return -1;
+		}
+		spec = strchr(spec, ',');
+		if (spec) {
+			spec++;
+		}
+	}
+
+	return 0;
+}
+
+const transport_t fault_transport = {
+	.name = "Faulty",
+	.open = NULL,
+	.close = fault_close,
+	.read = fault_read,
+	.writev = fault_writev,
+	.set_deadline = fault_set_deadline,
+	.get_time_us = fault_get_time_us,
+	.tx_time_us = fault_tx_time_us,
+	.set_speed = fault_set_speed,
+	.set_flow_control = fault_set_flow_control,
+	.set_low_latency = fault_set_low_latency,
+	.detach = fault_detach,
+	.get_stats = fault_get_stats,
+};
+
+void *fault_transport_wrap(const transport_t *tr, void *tr_ctx,
+			   const char *spec)
+{
+	fault_t *f;
+
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		return NULL;
+	}
+	f->tr = tr;
+	f->tr_ctx = tr_ctx;
+	f->rnd = 1;
+	f->delay_us = FAULT_DELAY_MS * 1000;
+	f->rx_timeout_ms = 3000;
+	if (fault_parse(f, spec) < 0) {
+		free(f);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return f;
+}
+
+void fault_transport_get_stats(void *ctx, fault_stats_t *stats)
+{
+	fault_t *f = ctx;
+
+	*stats = f->stats;
+}
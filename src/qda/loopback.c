@@ -0,0 +1,445 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "transport.h"
+#include "qda_device.h"
+
+/* Size of the buffer of bytes sent by the device and not read yet */
+#define LOOPBACK_RX_SIZE (4096)
+
+/*
+ * A loopback link.
+ */
+typedef struct {
+	qda_device_t *dev;
+	transport_stats_t stats;
+	/* Virtual time, in microseconds */
+	uint64_t now;
+	/* Receive timeout in milliseconds; set by loopback_set_deadline() */
+	int rx_timeout_ms;
+	/* Baud rate of the host side of the (virtual) link, initial and current */
+	int open_speed;
+	int link_speed;
+	/* Highest baud rate the link carries (0: no limit) */
+	int max_speed;
+	/* Per-byte error rate of the link above a baud rate (noise_speed) */
+	double noise;
+	int noise_speed;
+	/* State of the random generator of the noise (xorshift32) */
+	uint32_t rnd;
+	/* Round-trip latency of the link (e.g., USB-serial adapter) */
+	uint32_t latency_us;
+	/* Whether the low-latency mode of the link is enabled */
+	int low_latency;
+	/* Bytes sent by the device, and when the last of them is received */
+	uint8_t rx_buf[LOOPBACK_RX_SIZE];
+	/* Speed each of these bytes was sent at */
+	int rx_speed[LOOPBACK_RX_SIZE];
+	size_t rx_len;
+	uint64_t rx_ready;
+	/* Options of the device model */
+	char opts[];
+} loopback_t;
+
+static uint32_t loopback_wire_time_us(size_t len, int speed)
+{
+	return (uint64_t)len * 10 * 1000000 / speed;
+}
+
+static uint32_t loopback_tx_time_us(void *ctx, size_t len)
+{
+	loopback_t *lb = ctx;
+
+	return loopback_wire_time_us(len, lb->link_speed);
+}
+
+/*
+ * Get the speed of the device side of the link.
+ */
+static int loopback_dev_speed(const loopback_t *lb)
+{
+	uint32_t baud = qda_device_get_baud(lb->dev);
+
+	return baud ? (int)baud : lb->open_speed;
+}
+
+/*
+ * Get a byte as received on the other side of the link.
+ *
+ * It is garbled unless both sides use the same speed and the link carries
+ * it; above the noise speed, it may also get a bit flipped.
+ */
+static uint8_t loopback_wire(loopback_t *lb, uint8_t b, int tx_speed,
+			     int rx_speed)
+{
+	if ((tx_speed != rx_speed) ||
+	    (lb->max_speed && (tx_speed > lb->max_speed))) {
+		return ~b;
+	}
+	if (lb->noise_speed && (tx_speed > lb->noise_speed)) {
+		lb->rnd ^= lb->rnd << 13;
+		lb->rnd ^= lb->rnd >> 17;
+		lb->rnd ^= lb->rnd << 5;
+		if ((lb->rnd / 4294967296.0) < lb->noise) {
+			b ^= 1 << (lb->rnd % 8);
+		}
+	}
+
+	return b;
+}
+
+static uint64_t loopback_get_time_us(void *ctx)
+{
+	loopback_t *lb = ctx;
+
+	return lb->now;
+}
+
+/*
+ * Move the bytes the device sent into the receive buffer.
+ *
+ * They start leaving the device now (plus the latency of the link), or after
+ * the previous ones.
+ */
+static void loopback_collect(loopback_t *lb)
+{
+	int speed = loopback_dev_speed(lb);
+	uint32_t latency = lb->latency_us;
+	size_t len;
+	size_t i;
+
+	if (lb->low_latency && (latency > LOOPBACK_LOW_LATENCY_US)) {
+		latency = LOOPBACK_LOW_LATENCY_US;
+	}
+	len = qda_device_output(lb->dev, &lb->rx_buf[lb->rx_len],
+				sizeof(lb->rx_buf) - lb->rx_len);
+	if (len) {
+		if (lb->rx_ready < lb->now + latency) {
+			lb->rx_ready = lb->now + latency;
+		}
+		lb->rx_ready += loopback_wire_time_us(len, speed);
+		for (i = 0; i < len; i++) {
+			lb->rx_speed[lb->rx_len++] = speed;
+		}
+	}
+}
+
+/*
+ * Advance the virtual time, running the device timers expiring meanwhile.
+ */
+static void loopback_advance(loopback_t *lb, uint64_t to)
+{
+	uint64_t t;
+
+	while ((t = qda_device_next_timer(lb->dev)) <= to) {
+		if (lb->now < t) {
+			lb->now = t;
+		}
+		qda_device_poll(lb->dev, lb->now);
+		loopback_collect(lb);
+	}
+	if (lb->now < to) {
+		lb->now = to;
+	}
+}
+
+/*
+ * Write a scatter-gather list to the device.
+ *
+ * The call returns once the bytes have left the (virtual) wire, which is when
+ * the device gets them.
+ */
+static int loopback_writev(void *ctx, const transport_iovec_t *iov,
+			   int iovcnt)
+{
+	loopback_t *lb = ctx;
+	uint8_t wire[256];
+	size_t len = 0;
+	size_t off;
+	size_t n;
+	size_t j;
+	int i;
+
+	lb->stats.syscalls++;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].len;
+	}
+	loopback_advance(lb, lb->now + loopback_tx_time_us(lb, len));
+	for (i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].len; off += n) {
+			n = iov[i].len - off;
+			if (n > sizeof(wire)) {
+				/* A lone byte would be taken for a control one */
+				n = (n == sizeof(wire) + 1) ? n / 2
+							    : sizeof(wire);
+			}
+			for (j = 0; j < n; j++) {
+				wire[j] = loopback_wire(lb, iov[i].base[off + j],
+							lb->link_speed,
+							loopback_dev_speed(lb));
+			}
+			qda_device_input(lb->dev, wire, n, lb->now);
+		}
+	}
+	loopback_collect(lb);
+	lb->stats.tx_bytes += len;
+
+	return 0;
+}
+
+/*
+ * Read the bytes sent by the device.
+ *
+ * If there are none, the virtual time advances to the next device timer until
+ * the deadline expires.
+ */
+static int loopback_read(void *ctx, uint8_t *buf, size_t len)
+{
+	loopback_t *lb = ctx;
+	uint64_t deadline = lb->now + (uint64_t)lb->rx_timeout_ms * 1000;
+	uint64_t t;
+	size_t i;
+
+	lb->stats.syscalls++;
+	while (!lb->rx_len) {
+		t = qda_device_next_timer(lb->dev);
+		if (t > deadline) {
+			lb->now = deadline;
+			return -ETIMEDOUT;
+		}
+		loopback_advance(lb, t);
+	}
+	if (lb->now < lb->rx_ready) {
+		lb->now = lb->rx_ready;
+	}
+	if (len > lb->rx_len) {
+		len = lb->rx_len;
+	}
+	for (i = 0; i < len; i++) {
+		buf[i] = loopback_wire(lb, lb->rx_buf[i], lb->rx_speed[i],
+				       lb->link_speed);
+	}
+	memmove(lb->rx_buf, &lb->rx_buf[len], lb->rx_len - len);
+	memmove(lb->rx_speed, &lb->rx_speed[len],
+		(lb->rx_len - len) * sizeof(lb->rx_speed[0]));
+	lb->rx_len -= len;
+	lb->stats.rx_bytes += len;
+
+	return len;
+}
+
+static int loopback_set_deadline(void *ctx, int ms)
+{
+	loopback_t *lb = ctx;
+
+	lb->rx_timeout_ms = ms;
+
+	return 0;
+}
+
+/*
+ * Extract the link options from the option list, leaving the device ones.
+ *
+ * @return 0 on success, -1 if an option is invalid.
+ */
+static int loopback_parse_options(loopback_t *lb, char *opt)
+{
+	unsigned long v;
+	char *next;
+	char *val;
+	char *end;
+
+	while (opt && *opt) {
+		next = strchr(opt, ',');
+		if (!strncmp(opt, "noise=", 6)) {
+			/* <rate>@<baud> */
+			lb->noise = strtod(opt + 6, &val);
+			if ((val == opt + 6) || (*val != '@') || (lb->noise < 0) ||
+			    (lb->noise > 1)) {
+				return -1;
+			}
+			val++;
+		} else if (!strncmp(opt, "latency=", 8) ||
+			   !strncmp(opt, "maxlink=", 8)) {
+			val = opt + 8;
+		} else {
+			opt = next ? next + 1 : NULL;
+			continue;
+		}
+		v = strtoul(val, &end, 0);
+		if ((end == val) || ((*end != ',') && (*end != '\0'))) {
+			return -1;
+		}
+		if (opt[0] == 'n') {
+			lb->noise_speed = v;
+		} else if (opt[0] == 'l') {
+			lb->latency_us = v;
+		} else {
+			lb->max_speed = v;
+		}
+		/* Remove the option */
+		if (next) {
+			memmove(opt, next + 1, strlen(next + 1) + 1);
+		} else {
+			*opt = '\0';
+			if ((opt > lb->opts) && (opt[-1] == ',')) {
+				opt[-1] = '\0';
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void *loopback_open(const char *path, int speed)
+{
+	loopback_t *lb;
+	const char *opt;
+
+	if (strncmp(path, LOOPBACK_PATH, strlen(LOOPBACK_PATH)) || (speed <= 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	opt = path + strlen(LOOPBACK_PATH);
+	if (*opt == ':') {
+		opt++;
+	} else if (*opt != '\0') {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	lb = calloc(1, sizeof(*lb) + strlen(opt) + 1);
+	if (!lb) {
+		return NULL;
+	}
+	strcpy(lb->opts, opt);
+	if (loopback_parse_options(lb, lb->opts) < 0) {
+		free(lb);
+		errno = EINVAL;
+		return NULL;
+	}
+	lb->dev = qda_device_create(lb->opts);
+	if (!lb->dev) {
+		free(lb);
+		return NULL;
+	}
+	lb->rx_timeout_ms = 3000;
+	lb->open_speed = speed;
+	lb->link_speed = speed;
+	lb->rnd = 1;
+	loopback_collect(lb);
+
+	return lb;
+}
+
+static int loopback_close(void *ctx)
+{
+	loopback_t *lb = ctx;
+	int ret;
+
+	ret = qda_device_destroy(lb->dev);
+	free(lb);
+
+	return ret;
+}
+
+/*
+ * Change the speed of the host side of the link.
+ *
+ * Writes complete when the bytes have left the wire, so nothing is pending.
+ */
+static int loopback_set_speed(void *ctx, int speed)
+{
+	loopback_t *lb = ctx;
+
+	if (speed <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	lb->link_speed = speed;
+
+	return 0;
+}
+
+/*
+ * Enable or disable flow control: nothing to do, as the device model never
+ * loses bytes for lack of room.
+ */
+static int loopback_set_flow_control(void *ctx, int enable)
+{
+	(void)ctx;
+	(void)enable;
+
+	return 0;
+}
+
+/*
+ * Enable or disable the low-latency mode: it caps the latency of the link, as
+ * a shorter latency timer does on a USB-serial adapter.
+ */
+static int loopback_set_low_latency(void *ctx, int enable)
+{
+	loopback_t *lb = ctx;
+
+	lb->low_latency = enable;
+
+	return 0;
+}
+
+/*
+ * Reset the device into DFU mode, as the RTS line does on real hardware.
+ */
+static int loopback_detach(void *ctx)
+{
+	loopback_t *lb = ctx;
+
+	lb->rx_len = 0;
+	qda_device_reset(lb->dev, lb->now);
+	loopback_collect(lb);
+
+	return 0;
+}
+
+static void loopback_get_stats(void *ctx, transport_stats_t *out)
+{
+	loopback_t *lb = ctx;
+
+	*out = lb->stats;
+	out->link_time_us = lb->now;
+}
+
+const transport_t loopback_transport = {
+	.name = "Loopback",
+	.open = loopback_open,
+	.close = loopback_close,
+	.read = loopback_read,
+	.writev = loopback_writev,
+	.set_deadline = loopback_set_deadline,
+	.get_time_us = loopback_get_time_us,
+	.tx_time_us = loopback_tx_time_us,
+	.set_speed = loopback_set_speed,
+	.set_flow_control = loopback_set_flow_control,
+	.set_low_latency = loopback_set_low_latency,
+	.detach = loopback_detach,
+	.get_stats = loopback_get_stats,
+};
@@ -0,0 +1,217 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include "lz.h"
+
+/* Minimum length of a match */
+#define LZ_MIN_MATCH (4)
+
+/* Maximum distance of a match */
+#define LZ_MAX_OFFSET (65535)
+
+/*
+ * End of block rules of the LZ4 format: the last bytes are always literals,
+ * and the last match starts early enough before the end.
+ */
+#define LZ_LAST_LITERALS (5)
+#define LZ_MFLIMIT (12)
+
+/* Size of the hash table of the compressor (entries) */
+#define LZ_HASH_BITS (12)
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Write a length in the token extension format (runs of 255).
+ *
+ * @return The position after the length, or 0 if it does not fit.
+ */
+static size_t lz_put_len(uint8_t *out, size_t pos, size_t out_size, size_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (pos >= out_size) {
+			return 0;
+		}
+		out[pos++] = 255;
+	}
+	if (pos >= out_size) {
+		return 0;
+	}
+	out[pos++] = n;
+
+	return pos;
+}
+
+/*
+ * Write a sequence: literals, then a match (none if 'mlen' is 0).
+ *
+ * @return The position after the sequence, or 0 if it does not fit.
+ */
+static size_t lz_put_seq(uint8_t *out, size_t pos, size_t out_size,
+			 const uint8_t *lit, size_t llen, size_t offset,
+			 size_t mlen)
+{
+	size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	if (pos >= out_size) {
+		return 0;
+	}
+	out[pos++] = ((llen < 15 ? llen : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if ((llen >= 15) &&
+	    !(pos = lz_put_len(out, pos, out_size, llen - 15))) {
+		return 0;
+	}
+	if (llen > out_size - pos) {
+		return 0;
+	}
+	memcpy(&out[pos], lit, llen);
+	pos += llen;
+	if (!mlen) {
+		return pos;
+	}
+	if (out_size - pos < 2) {
+		return 0;
+	}
+	out[pos++] = offset & 0xFF;
+	out[pos++] = offset >> 8;
+	if ((mcode >= 15) &&
+	    !(pos = lz_put_len(out, pos, out_size, mcode - 15))) {
+		return 0;
+	}
+
+	return pos;
+}
+
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out,
+		   size_t out_size)
+{
+	int32_t table[1 << LZ_HASH_BITS];
+	size_t anchor = 0;
+	size_t pos = 0;
+	size_t ip = 0;
+	size_t ref;
+	size_t mlen;
+	uint32_t h;
+
+	if (len > LZ_MAX_OFFSET) {
+		return 0;
+	}
+	memset(table, 0xFF, sizeof(table));
+	/* Greedy parsing: take the first match found through the hash table */
+	while (ip + LZ_MFLIMIT < len) {
+		h = lz_hash(&in[ip]);
+		ref = table[h];
+		table[h] = ip;
+		if ((ref == (size_t)-1) ||
+		    (lz_read32(&in[ref]) != lz_read32(&in[ip]))) {
+			ip++;
+			continue;
+		}
+		mlen = LZ_MIN_MATCH;
+		while ((ip + mlen < len - LZ_LAST_LITERALS) &&
+		       (in[ref + mlen] == in[ip + mlen])) {
+			mlen++;
+		}
+		pos = lz_put_seq(out, pos, out_size, &in[anchor], ip - anchor,
+				 ip - ref, mlen);
+		if (!pos) {
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	return lz_put_seq(out, pos, out_size, &in[anchor], len - anchor, 0, 0);
+}
+
+/*
+ * Read a length in the token extension format.
+ *
+ * @return 0 on success, -1 if the input ends first.
+ */
+static int lz_get_len(const uint8_t *in, size_t in_len, size_t *ip, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= in_len) {
+			return -1;
+		}
+		b = in[(*ip)++];
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+		  size_t out_len)
+{
+	size_t ip = 0;
+	size_t op = 0;
+	size_t offset;
+	size_t n;
+	uint8_t token;
+
+	while (ip < in_len) {
+		token = in[ip++];
+		/* Literals */
+		n = token >> 4;
+		if ((n == 15) && (lz_get_len(in, in_len, &ip, &n) < 0)) {
+			return -1;
+		}
+		if ((n > in_len - ip) || (n > out_len - op)) {
+			return -1;
+		}
+		memcpy(&out[op], &in[ip], n);
+		ip += n;
+		op += n;
+		if (ip == in_len) {
+			/* The last sequence has no match */
+			break;
+		}
+		/* Match: it may overlap the bytes it produces */
+		if (in_len - ip < 2) {
+			return -1;
+		}
+		offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		n = token & 0x0F;
+		if ((n == 15) && (lz_get_len(in, in_len, &ip, &n) < 0)) {
+			return -1;
+		}
+		n += LZ_MIN_MATCH;
+		if (!offset || (offset > op) || (n > out_len - op)) {
+			return -1;
+		}
+		for (; n; n--, op++) {
+			out[op] = out[op - offset];
+		}
+	}
+
+	return op;
+}
@@ -0,0 +1,62 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Compression of DNLOAD blocks.
+ *
+ * The format is the LZ4 block format: a sequence of tokens, each giving a
+ * number of literal bytes (copied as they are) followed by a match (a copy of
+ * bytes already decoded, at most 65535 bytes back). Decoding needs no memory
+ * other than the output buffer, which suits an MCU writing into flash.
+ */
+
+/**
+ * Compress a block.
+ *
+ * @param[in]  in       The data to compress (at most 65535 bytes).
+ * @param[in]  len      The length of the data.
+ * @param[out] out      The buffer for the compressed data.
+ * @param[in]  out_size The size of the buffer.
+ *
+ * @return The length of the compressed data, or 0 if it does not fit into the
+ * 	   buffer (e.g., the data does not compress).
+ */
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out,
+		   size_t out_size);
+
+/**
+ * Decompress a block (reference decoder).
+ *
+ * @param[in]  in      The compressed data.
+ * @param[in]  in_len  The length of the compressed data.
+ * @param[out] out     The buffer for the decompressed data.
+ * @param[in]  out_len The size of the buffer.
+ *
+ * @return The length of the decompressed data, or -1 if the compressed data
+ * 	   is invalid or does not fit into the buffer.
+ */
+int lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+		  size_t out_len);
+
+#endif /* __LZ_H__ */
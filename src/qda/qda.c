@@ -21,7 +21,9 @@
 #include <stdio.h>
 #include <string.h>
 #include "qda.h"
+#include "lz.h"
 #include "usb_dfu.h"
+#include "dfu_file.h"
 
 /* For x86 hosts we do not have to do any conversion */
 #define htoq32(val) (val)
@@ -45,52 +47,110 @@
 		} \
 	} while(0) \
 
-qda_conf_t *qda_conf;
+/*
+ * Send a request through the session's send callback.
+ */
+static int qda_send(qda_t *qda, void *req, size_t len)
+{
+	return qda->conf->send(qda->conf->ctx, req, len);
+}
+
+/*
+ * Send a request made of a header in the session buffer followed by data.
+ *
+ * The data is sent in place if the scatter-gather callback is available, and
+ * copied after the header otherwise.
+ */
+static int qda_send_data(qda_t *qda, size_t hdr_len, const uint8_t *data,
+			 size_t len)
+{
+	qda_iov_t iov[2];
+
+	if (qda->conf->sendv) {
+		iov[0].base = qda->buf;
+		iov[0].len = hdr_len;
+		iov[1].base = (uint8_t *)data;
+		iov[1].len = len;
+		return qda->conf->sendv(qda->conf->ctx, iov, 2);
+	}
+	if (len > sizeof(qda->buf) - hdr_len) {
+		return -1;
+	}
+	memcpy(&qda->buf[hdr_len], data, len);
+
+	return qda_send(qda, qda->buf, hdr_len + len);
+}
 
-/* NOTE: make the size of the payload dynamic */
-static uint8_t qda_buf[8192];
+/*
+ * Check whether a block consists only of the given value.
+ */
+static int qda_is_filled(const uint8_t *data, size_t len, int value)
+{
+	while (len--) {
+		if (*data++ != value) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Receive a response into the session buffer.
+ */
+static size_t qda_receive(qda_t *qda)
+{
+	return qda->conf->receive(qda->conf->ctx, qda->buf, sizeof(qda->buf));
+}
 
-int qda_init(qda_conf_t *conf)
+int qda_init(qda_t *qda, const qda_conf_t *conf)
 {
-	qda_conf = conf;
+	qda->conf = conf;
+	qda->caps = 0;
+	qda->data_bytes = 0;
+	qda->fill_bytes = 0;
+	qda->compress = 0;
+	qda->erased = -1;
+	qda->delta = 0;
+	qda->crc_count = 0;
 	return 0;
 }
 
-int qda_reset()
+int qda_reset(qda_t *qda)
 {
 	printd("qda_reset...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_RESET);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(req->type));
+	rc = qda_send(qda, req, sizeof(req->type));
 	FAIL_IF(rc < 0);
-	rc = qda_conf->receive(qda_buf, sizeof(qda_buf));
-	FAIL_IF(rc >= (int) sizeof(qda_buf));
+	rc = qda_receive(qda);
+	FAIL_IF(rc >= (int) sizeof(qda->buf));
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
 	printd("[DONE]\n");
 	return 0;
 }
 
-int qda_get_dev_desc(qda_if_t *dif)
+int qda_get_dev_desc(qda_t *qda, qda_if_t *dif)
 {
 	printd("qda_get_dev_desc...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	dev_desc_resp_payload_t *pl;
 
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DEV_DESC_REQ);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(req->type));
+	rc = qda_send(qda, req, sizeof(req->type));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_DEV_DESC_RESP));
 	pl = (dev_desc_resp_payload_t *)resp->payload;
 
@@ -106,21 +166,52 @@ int qda_get_dev_desc(qda_if_t *dif)
 	return 0;
 }
 
-int qda_get_dfu_desc(qda_if_t *dif)
+int qda_get_caps(qda_t *qda, uint32_t *caps)
+{
+	printd("qda_get_caps...\t");
+	int rc;
+	qda_pkt_t *req, *resp;
+	caps_resp_payload_t *pl;
+
+	req = (qda_pkt_t *)qda->buf;
+	req->type = htoq32(QDA_PKT_CAPS_REQ);
+
+	rc = qda_send(qda, req, sizeof(req->type));
+	FAIL_IF(rc < 0);
+	rc = qda_receive(qda);
+
+	resp = (qda_pkt_t *)qda->buf;
+	if (resp->type == htoq32(QDA_PKT_STALL)) {
+		/* Legacy device: no extension */
+		qda->caps = 0;
+	} else {
+		FAIL_IF(resp->type != htoq32(QDA_PKT_CAPS_RESP));
+		FAIL_IF(rc < (int)(sizeof(*resp) + sizeof(*pl)));
+		pl = (caps_resp_payload_t *)resp->payload;
+		qda->caps = qtoh32(pl->caps);
+	}
+	*caps = qda->caps;
+
+	printd("[DONE]\n");
+	printd("\tcaps: 0x%08x\n", qda->caps);
+	return 0;
+}
+
+int qda_get_dfu_desc(qda_t *qda, qda_if_t *dif)
 {
 	printd("qda_get_dfu_desc...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	dfu_desc_resp_payload_t *pl;
 
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_DESC_REQ);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(req->type));
+	rc = qda_send(qda, req, sizeof(req->type));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_DFU_DESC_RESP));
 	pl = (dfu_desc_resp_payload_t *)resp->payload;
 
@@ -139,110 +230,192 @@ int qda_get_dfu_desc(qda_if_t *dif)
 	return 0;
 }
 
-int qda_set_alt_setting(uint8_t alt)
+int qda_set_alt_setting(qda_t *qda, uint8_t alt)
 {
 	printd("qda_set_dfu_alt_setting...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	set_alt_setting_payload_t *pl;
 
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_SET_ALT_SETTING);
 	pl = (set_alt_setting_payload_t *)req->payload;
 	pl->alt_setting = alt;
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(req->type) + sizeof(*pl));
+	rc = qda_send(qda, req, sizeof(req->type) + sizeof(*pl));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
 	printd("[DONE]\n");
 	return 0;
 }
 
-int qda_dfu_detach(void)
+int qda_set_baud(qda_t *qda, uint32_t baud, uint16_t timeout_ms)
+{
+	printd("qda_set_baud...\t");
+	int rc;
+	qda_pkt_t *req, *resp;
+	set_baud_req_payload_t *pl;
+
+	FAIL_IF(!(qda->caps & QDA_CAP_SET_BAUD));
+	req = (qda_pkt_t *)qda->buf;
+	req->type = htoq32(QDA_PKT_SET_BAUD_REQ);
+	pl = (set_baud_req_payload_t *)req->payload;
+	pl->baud = htoq32(baud);
+	pl->timeout_ms = htoq16(timeout_ms);
+
+	rc = qda_send(qda, req, sizeof(req->type) + sizeof(*pl));
+	FAIL_IF(rc < 0);
+	qda_receive(qda);
+
+	resp = (qda_pkt_t *)qda->buf;
+	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
+	printd("[DONE]\n");
+	return 0;
+}
+
+int qda_dfu_detach(qda_t *qda)
 {
 	printd("qda_dfu_detach...\t");
-	FAIL_IF(qda_conf->detach() < 0);
+	FAIL_IF(qda->conf->detach(qda->conf->ctx) < 0);
 	printd("[DONE]\n");
 	return 0;
 }
 
-int qda_dfu_download(uint16_t len, uint16_t transaction, const uint8_t *data)
+int qda_dfu_download(qda_t *qda, uint16_t len, uint16_t transaction,
+		     const uint8_t *data)
 {
 	printd("qda_dfu_dnload (len=%d)\nstarting...\t\t", len);
 	int rc;
 	qda_pkt_t *req, *resp;
 	dnload_req_payload_t *pl;
-
-	req = (qda_pkt_t *)qda_buf;
-	req->type = htoq32(QDA_PKT_DFU_DNLOAD_REQ);
-	pl = (dnload_req_payload_t *)req->payload;
-	pl->data_len = len;
-	pl->block_num = transaction;
-	if (len > (sizeof(qda_buf) - sizeof(*req) - sizeof(*pl))) {
-		return -1;
+	dnload_lz_req_payload_t *lz;
+	dnload_fill_req_payload_t *fill;
+	size_t zmax = sizeof(qda->zbuf);
+	size_t zlen = 0;
+	int filled = 0;
+
+	req = (qda_pkt_t *)qda->buf;
+	if ((qda->erased >= 0) && (qda->caps & QDA_CAP_DNLOAD_FILL) && len &&
+	    qda_is_filled(data, len, qda->erased)) {
+		printd("(erased) ");
+		req->type = htoq32(QDA_PKT_DFU_DNLOAD_FILL_REQ);
+		fill = (dnload_fill_req_payload_t *)req->payload;
+		fill->data_len = len;
+		fill->block_num = transaction;
+		fill->value = qda->erased;
+		rc = qda_send(qda, req, sizeof(*req) + sizeof(*fill));
+		filled = 1;
+		goto sent;
 	}
-	memcpy(pl->data, data, len);
-
-	rc = qda_conf->send((uint8_t *)req,
-				sizeof(*req) + sizeof(*pl) + pl->data_len);
+	if (qda->compress && (qda->caps & QDA_CAP_LZ_DNLOAD) && (len > 1)) {
+		/* Only worth it if the block gets smaller */
+		if (zmax > (size_t)len - 1) {
+			zmax = len - 1;
+		}
+		zlen = lz_compress(data, len, qda->zbuf, zmax);
+	}
+	if (zlen) {
+		printd("(compressed to %d) ", (int)zlen);
+		req->type = htoq32(QDA_PKT_DFU_DNLOAD_LZ_REQ);
+		lz = (dnload_lz_req_payload_t *)req->payload;
+		lz->data_len = len;
+		lz->block_num = transaction;
+		lz->comp_len = zlen;
+		rc = qda_send_data(qda, sizeof(*req) + sizeof(*lz), qda->zbuf,
+				   zlen);
+	} else {
+		req->type = htoq32(QDA_PKT_DFU_DNLOAD_REQ);
+		pl = (dnload_req_payload_t *)req->payload;
+		pl->data_len = len;
+		pl->block_num = transaction;
+		rc = qda_send_data(qda, sizeof(*req) + sizeof(*pl), data, len);
+	}
+sent:
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
+	if (filled) {
+		qda->fill_bytes += len;
+	} else {
+		qda->data_bytes += len;
+	}
 
 	printd("[DONE]\n");
 	return 0;
 }
 
-int qda_dfu_upload(uint16_t len, uint16_t transaction, uint8_t *data)
+int qda_dfu_upload(qda_t *qda, uint16_t len, uint16_t transaction,
+		   uint8_t *data)
 {
 	printd("qda_dfu_upload...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	upload_req_payload_t *pl_req;
 	upload_resp_payload_t *pl_resp;
+	qda_iov_t iov[3];
+	size_t hdr_len;
 	int retv;
 
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_UPLOAD_REQ);
 	pl_req = (upload_req_payload_t *)req->payload;
 	pl_req->max_data_len = len;
 	pl_req->block_num = transaction;
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(*req) + sizeof(*pl_req));
+	rc = qda_send(qda, req, sizeof(*req) + sizeof(*pl_req));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	resp = (qda_pkt_t *)qda->buf;
+	pl_resp = (upload_resp_payload_t *)resp->payload;
+	if (qda->conf->receivev) {
+		/*
+		 * Receive the header into the session buffer and the data in
+		 * place; the rest of the session buffer takes the XMODEM
+		 * padding.
+		 */
+		hdr_len = sizeof(*resp) + sizeof(*pl_resp);
+		iov[0].base = qda->buf;
+		iov[0].len = hdr_len;
+		iov[1].base = data;
+		iov[1].len = len;
+		iov[2].base = &qda->buf[hdr_len];
+		iov[2].len = sizeof(qda->buf) - hdr_len;
+		qda->conf->receivev(qda->conf->ctx, iov, 3);
+	} else {
+		qda_receive(qda);
+	}
 
-	resp = (qda_pkt_t *)qda_buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_DFU_UPLOAD_RESP));
-	pl_resp = (upload_resp_payload_t *)resp->payload;
 	retv = qtoh16(pl_resp->data_len);
 	FAIL_IF(retv > len);
-	memcpy(data, pl_resp->data, retv);
+	if (!qda->conf->receivev) {
+		memcpy(data, pl_resp->data, retv);
+	}
+	qda->data_bytes += retv;
 
 	printd("[DONE]\n");
 	printd("\tlen: %d\t", retv);
 	return retv;
 }
 
-int qda_dfu_getstatus(dfu_status_t *status)
+int qda_dfu_getstatus(qda_t *qda, dfu_status_t *status)
 {
 	printd("qda_dfu_getstatus...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	get_status_resp_payload_t *pl;
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_GETSTATUS_REQ);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(*req));
+	rc = qda_send(qda, req, sizeof(*req));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_DFU_GETSTATUS_RESP));
 	pl = (get_status_resp_payload_t *)resp->payload;
 	status->bState = pl->state;
@@ -253,39 +426,39 @@ int qda_dfu_getstatus(dfu_status_t *status)
 	return 0;
 }
 
-int qda_dfu_clrstatus()
+int qda_dfu_clrstatus(qda_t *qda)
 {
 	printd("qda_dfu_clrstatus...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_CLRSTATUS);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(*req));
+	rc = qda_send(qda, req, sizeof(*req));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
 
 	printd("[DONE]\n");
 	return 0;
 }
 
-int qda_dfu_getstate()
+int qda_dfu_getstate(qda_t *qda)
 {
 	printd("qda_dfu_getstate...\t");
 	int rc;
 	qda_pkt_t *req, *resp;
 	get_state_resp_payload_t *pl;
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_GETSTATE_REQ);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(*req));
+	rc = qda_send(qda, req, sizeof(*req));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_DFU_GETSTATE_RESP));
 	pl = (get_state_resp_payload_t *)resp->payload;
 
@@ -293,19 +466,19 @@ int qda_dfu_getstate()
 	return pl->state;
 }
 
-int qda_dfu_abort()
+int qda_dfu_abort(qda_t *qda)
 {
 	printd("qda_dfu_abort...\t\t");
 	int rc;
 	qda_pkt_t *req, *resp;
-	req = (qda_pkt_t *)qda_buf;
+	req = (qda_pkt_t *)qda->buf;
 	req->type = htoq32(QDA_PKT_DFU_ABORT);
 
-	rc = qda_conf->send((uint8_t *)req, sizeof(*req));
+	rc = qda_send(qda, req, sizeof(*req));
 	FAIL_IF(rc < 0);
-	qda_conf->receive(qda_buf, sizeof(qda_buf));
+	qda_receive(qda);
 
-	resp = (qda_pkt_t *)qda_buf;
+	resp = (qda_pkt_t *)qda->buf;
 	FAIL_IF(resp->type != htoq32(QDA_PKT_ACK));
 
 	printd("[DONE]\n");
@@ -377,6 +550,124 @@ static const char *dfu_state_names[] = {
 	"dfuERROR",
 };
 
+void qda_set_compression(qda_t *qda, int enable)
+{
+	qda->compress = enable;
+}
+
+void qda_set_erased_value(qda_t *qda, int value)
+{
+	qda->erased = value;
+}
+
+void qda_set_delta(qda_t *qda, int enable)
+{
+	qda->delta = enable;
+}
+
+int qda_dfu_can_skip(const qda_t *qda)
+{
+	return !!(qda->caps & QDA_CAP_DELTA_DNLOAD);
+}
+
+int qda_dfu_delta_begin(qda_t *qda, uint16_t block_len, uint32_t len)
+{
+	qda->crc_count = 0;
+	qda->delta_block_len = block_len;
+	qda->delta_end = len;
+
+	return qda->delta && qda_dfu_can_skip(qda) && block_len;
+}
+
+/*
+ * Read the CRCs of a batch of device blocks, starting at the given one.
+ */
+static int qda_dfu_get_crcs(qda_t *qda, uint16_t block_num)
+{
+	printd("qda_dfu_get_crcs...\t");
+	int rc;
+	int i;
+	qda_pkt_t *req, *resp;
+	crc_req_payload_t *pl_req;
+	crc_resp_payload_t *pl_resp;
+
+	req = (qda_pkt_t *)qda->buf;
+	req->type = htoq32(QDA_PKT_DFU_CRC_REQ);
+	pl_req = (crc_req_payload_t *)req->payload;
+	pl_req->block_num = block_num;
+	pl_req->count = QDA_CRC_BATCH;
+	pl_req->block_len = qda->delta_block_len;
+	pl_req->end = qda->delta_end;
+
+	rc = qda_send(qda, req, sizeof(*req) + sizeof(*pl_req));
+	FAIL_IF(rc < 0);
+	rc = qda_receive(qda);
+
+	resp = (qda_pkt_t *)qda->buf;
+	pl_resp = (crc_resp_payload_t *)resp->payload;
+	FAIL_IF(resp->type != htoq32(QDA_PKT_DFU_CRC_RESP));
+	FAIL_IF(rc < (int)(sizeof(*resp) + sizeof(*pl_resp)));
+	qda->crc_count = qtoh16(pl_resp->count);
+	FAIL_IF(qda->crc_count > QDA_CRC_BATCH);
+	FAIL_IF(rc < (int)(sizeof(*resp) + sizeof(*pl_resp) +
+			   qda->crc_count * sizeof(pl_resp->crc[0])));
+	for (i = 0; i < qda->crc_count; i++) {
+		qda->crc[i] = qtoh32(pl_resp->crc[i]);
+	}
+	qda->crc_first = block_num;
+
+	printd("[DONE]\n");
+	return 0;
+}
+
+int qda_dfu_unchanged(qda_t *qda, uint16_t transaction, const uint8_t *data,
+		      uint16_t len)
+{
+	int rc;
+
+	if ((transaction < qda->crc_first) ||
+	    (transaction - qda->crc_first >= qda->crc_count)) {
+		qda->crc_count = 0;
+		rc = qda_dfu_get_crcs(qda, transaction);
+		if (rc < 0) {
+			return rc;
+		}
+		if (!qda->crc_count) {
+			/* The block is beyond the flash */
+			return 0;
+		}
+	}
+
+	return qda->crc[transaction - qda->crc_first] ==
+	       (uint32_t)~dfu_file_crc(0xffffffff, data, len);
+}
+
+unsigned long qda_get_data_bytes(const qda_t *qda)
+{
+	return qda->data_bytes;
+}
+
+unsigned long qda_get_fill_bytes(const qda_t *qda)
+{
+	return qda->fill_bytes;
+}
+
+void qda_report_stats(qda_t *qda)
+{
+	if (qda->conf->report_stats) {
+		qda->conf->report_stats(qda->conf->ctx);
+	}
+}
+
+int qda_adapt_link(qda_t *qda)
+{
+	if (!qda->conf->adapt) {
+		return 0;
+	}
+
+	return qda->conf->adapt(qda->conf->ctx);
+}
+
 const char *qda_dfu_state_to_string(int state)
 {
 	if (state > DFU_STATE_dfuERROR)
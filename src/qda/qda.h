@@ -36,6 +36,29 @@ typedef struct dfu_status {
 	unsigned char iString;
 } dfu_status_t;
 
+/**
+ * Size of the QDA session buffer.
+ *
+ * It must hold any (padded) response to a request without user data; the
+ * user data of DNLOAD / UPLOAD requests is transferred in place when the
+ * scatter-gather callbacks are available.
+ */
+#define QDA_BUF_SIZE (1280)
+
+/**
+ * Size of the buffer for compressed DNLOAD data.
+ *
+ * Blocks whose compressed data does not fit are sent uncompressed.
+ */
+#define QDA_ZBUF_SIZE (4096)
+
+/**
+ * Number of block CRCs asked for at once in delta downloads.
+ */
+#define QDA_CRC_BATCH (64)
+
+struct qda_s;
+
 /**
  * QDA interface structure
  */
@@ -47,15 +70,30 @@ typedef struct dfu_if {
 	uint8_t interface;
 	uint8_t altsetting;
 	uint8_t bMaxPacketSize0;
+	struct qda_s *dev_handle;
 } qda_if_t;
 
+/**
+ * A segment of a QDA message, for scatter-gather I/O.
+ */
+typedef struct {
+	uint8_t *base;
+	size_t len;
+} qda_iov_t;
+
 /**
  * QDA Configuration structure.
  */
 typedef struct qda_conf_s {
+	/**
+	 * Context passed to all the callbacks (e.g., the link to the device).
+	 */
+	void *ctx;
+
 	/**
 	 * QDA send callback.
 	 *
+	 * @param[in] ctx The callback context.
 	 * @param[in] data Data to be sent.
 	 * @param[in] len Length of data to be sent.
 	 *
@@ -63,95 +101,230 @@ typedef struct qda_conf_s {
 	 * @retval 0 Success
 	 * @retval -1 Error
 	 */
-	int (*send)(uint8_t *data, size_t len);
+	int (*send)(void *ctx, uint8_t *data, size_t len);
 
 	/**
 	 * QDA receive callback.
 	 *
+	 * @param[in] ctx The callback context.
 	 * @param[out] data Data buffer for received bytes.
 	 * @param[in] len Maximum allocated bytes that can be received.
 	 *
 	 * @return Length of received data.
 	 */
-	size_t (*receive)(uint8_t *data, size_t len);
+	size_t (*receive)(void *ctx, uint8_t *data, size_t len);
+
+	/**
+	 * QDA scatter-gather send callback (optional).
+	 *
+	 * If set, it is used for messages carrying user data, which are then
+	 * sent directly from the user's buffer.
+	 *
+	 * @param[in] ctx    The callback context.
+	 * @param[in] iov    The segments of the message.
+	 * @param[in] iovcnt The number of segments.
+	 *
+	 * @return Error Status
+	 * @retval 0 Success
+	 * @retval -1 Error
+	 */
+	int (*sendv)(void *ctx, const qda_iov_t *iov, int iovcnt);
+
+	/**
+	 * QDA scatter-gather receive callback (optional).
+	 *
+	 * If set, it is used for messages carrying user data, which are then
+	 * received directly into the user's buffer.
+	 *
+	 * @param[in] ctx    The callback context.
+	 * @param[in] iov    The segments where to store the message.
+	 * @param[in] iovcnt The number of segments.
+	 *
+	 * @return Length of received data.
+	 */
+	size_t (*receivev)(void *ctx, const qda_iov_t *iov, int iovcnt);
 
 	/**
 	 * QDA detach callback.
 	 *
+	 * @param[in] ctx The callback context.
+	 *
 	 * @return Error Status
 	 * @retval 0 Success
 	 * @retval -1 Error
 	 **/
-	int (*detach)(void);
+	int (*detach)(void *ctx);
+
+	/**
+	 * QDA statistics report callback (optional).
+	 *
+	 * It prints the statistics of the link (e.g., XMODEM counters).
+	 *
+	 * @param[in] ctx The callback context.
+	 */
+	void (*report_stats)(void *ctx);
+
+	/**
+	 * QDA link adaptation callback (optional).
+	 *
+	 * It is called between DNLOAD / UPLOAD blocks and may change the
+	 * speed of the link, depending on its error rate.
+	 *
+	 * @param[in] ctx The callback context.
+	 *
+	 * @return Error Status
+	 * @retval 0 Success (whether the speed changed or not)
+	 * @retval -1 Error (the device does not answer anymore)
+	 */
+	int (*adapt)(void *ctx);
 } qda_conf_t;
 
 /**
- * Init QDA and set configuration.
+ * A QDA session.
+ *
+ * It holds the state of the QDA conversation with one device, so that several
+ * devices can be driven at the same time. It must be initialized with
+ * qda_init(); its fields are private to QDA.
+ */
+typedef struct qda_s {
+	/** The configuration (callbacks) of the session. */
+	const qda_conf_t *conf;
+	/** Capabilities of the device (QDA_CAP_*), see qda_get_caps(). */
+	uint32_t caps;
+	/** Firmware bytes transferred (DNLOAD / UPLOAD data). */
+	unsigned long data_bytes;
+	/** Firmware bytes written with fill requests (not transferred). */
+	unsigned long fill_bytes;
+	/** Whether DNLOAD data is compressed, see qda_set_compression(). */
+	int compress;
+	/** Erased flash value (or -1), see qda_set_erased_value(). */
+	int erased;
+	/** Whether unchanged blocks are skipped, see qda_set_delta(). */
+	int delta;
+	/** Block size and image length of the delta download. */
+	uint16_t delta_block_len;
+	uint32_t delta_end;
+	/** CRCs of the device blocks crc_first to crc_first + crc_count - 1. */
+	uint16_t crc_first;
+	uint16_t crc_count;
+	uint32_t crc[QDA_CRC_BATCH];
+	/** Buffer for requests and responses. */
+	uint8_t buf[QDA_BUF_SIZE];
+	/** Buffer for compressed DNLOAD data. */
+	uint8_t zbuf[QDA_ZBUF_SIZE];
+} qda_t;
+
+/**
+ * Init a QDA session and set its configuration.
  *
- * @paqram[in] conf A QDA configuration structure.
+ * @param[out] qda The session to initialize.
+ * @param[in] conf A QDA configuration structure. It must remain valid as long
+ * 		   as the session is used.
  *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
   */
-int qda_init(qda_conf_t *conf);
+int qda_init(qda_t *qda, const qda_conf_t *conf);
 
 /**
  * Reset QDA device.
  *
+ * @param[in] qda The QDA session.
+ *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_reset();
+int qda_reset(qda_t *qda);
 
 /**
  * Get device description.
  *
+ * @param[in] qda The QDA session.
  * @param[out] dif Target structure to update configuration values.
  *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_get_dev_desc(qda_if_t *dif);
+int qda_get_dev_desc(qda_t *qda, qda_if_t *dif);
+
+/**
+ * Get device capabilities.
+ *
+ * The capabilities are also stored in the session. A device that does not
+ * support the request has no capabilities.
+ *
+ * @param[in] qda The QDA session.
+ * @param[out] caps The capabilities (QDA_CAP_*).
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error
+ */
+int qda_get_caps(qda_t *qda, uint32_t *caps);
 
 /**
  * Get DFU description.
  *
+ * @param[in] qda The QDA session.
  * @param[out] dif Target structure to update configuration values.
  *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_get_dfu_desc(qda_if_t *dif);
+int qda_get_dfu_desc(qda_t *qda, qda_if_t *dif);
 
 /**
  * Set alternate setting.
  *
+ * @param[in] qda The QDA session.
  * @param[in] alt Alternate setting to be set.
  *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_set_alt_setting(uint8_t alt);
+int qda_set_alt_setting(qda_t *qda, uint8_t alt);
+
+/**
+ * Have the device change the speed of its UART.
+ *
+ * The device switches once it has answered, and goes back to the current
+ * speed unless it gets a request at the new one within the timeout. The host
+ * side of the link must be switched by the caller.
+ *
+ * @param[in] qda        The QDA session.
+ * @param[in] baud       The new speed.
+ * @param[in] timeout_ms How long the device waits for a request at the new
+ * 			 speed.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (e.g., the device does not support QDA_CAP_SET_BAUD or
+ * 	      the speed)
+ */
+int qda_set_baud(qda_t *qda, uint32_t baud, uint16_t timeout_ms);
 
 /**
  * Detach device and enter DFU mode.
  *
+ * @param[in] qda The QDA session.
+ *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_detach(void);
+int qda_dfu_detach(qda_t *qda);
 
 /**
  * Perform a DFU download.
  *
  * Write firmware data to the target device.
  *
+ * @param[in] qda The QDA session.
  * @param[in] len Length of block.
  * @param[in] transaction Block number.
  * @param[in] data Pointer to data.
@@ -160,13 +333,15 @@ int qda_dfu_detach(void);
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_download(uint16_t len, uint16_t transaction, const uint8_t *data);
+int qda_dfu_download(qda_t *qda, uint16_t len, uint16_t transaction,
+		     const uint8_t *data);
 
 /**
  * Perform a DFU upload.
  *
  * Read firmware data from target device.
  *
+ * @param[in] qda The QDA session.
  * @param[in] len Length of block.
  * @param[in] transaction Block number.
  * @param[out] data Pointer to data.
@@ -176,45 +351,177 @@ int qda_dfu_download(uint16_t len, uint16_t transaction, const uint8_t *data);
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_upload(uint16_t len, uint16_t transaction, uint8_t *data);
+int qda_dfu_upload(qda_t *qda, uint16_t len, uint16_t transaction,
+		   uint8_t *data);
 
 /**
  * Request device's DFU status.
  *
+ * @param[in] qda The QDA session.
  * @param[out] status The current DFU status.
  *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_getstatus(dfu_status_t *status);
+int qda_dfu_getstatus(qda_t *qda, dfu_status_t *status);
 
 /**
  * Clear device's DFU status.
  *
+ * @param[in] qda The QDA session.
+ *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_clrstatus();
+int qda_dfu_clrstatus(qda_t *qda);
 
 /**
  * Request device's DFU state.
  *
+ * @param[in] qda The QDA session.
+ *
  * @return Success or error State
  * @retval >=0 DFU State
  * @retval -1 Error
  */
-int qda_dfu_getstate();
+int qda_dfu_getstate(qda_t *qda);
 
 /**
  * Send DFU abort message to device.
  *
+ * @param[in] qda The QDA session.
+ *
  * @return Error Status
  * @retval 0 Success
  * @retval -1 Error
  */
-int qda_dfu_abort();
+int qda_dfu_abort(qda_t *qda);
+
+/**
+ * Enable or disable the compression of DNLOAD data.
+ *
+ * Compression is only used if the device supports it (QDA_CAP_LZ_DNLOAD, see
+ * qda_get_caps()), and only for the blocks it makes smaller; the other blocks
+ * are sent as they are.
+ *
+ * @param[in] qda    The QDA session.
+ * @param[in] enable Whether to compress.
+ */
+void qda_set_compression(qda_t *qda, int enable);
+
+/**
+ * Set the erased value of the flash.
+ *
+ * DNLOAD blocks made only of this value are then sent as fill requests, i.e.,
+ * without their data, if the device supports it (QDA_CAP_DNLOAD_FILL, see
+ * qda_get_caps()).
+ *
+ * @param[in] qda   The QDA session.
+ * @param[in] value The erased value (0-255), or -1 to send every block.
+ */
+void qda_set_erased_value(qda_t *qda, int value);
+
+/**
+ * Enable or disable delta downloads.
+ *
+ * When enabled, and if the device supports it (QDA_CAP_DELTA_DNLOAD, see
+ * qda_get_caps()), the blocks already holding the right data are not
+ * downloaded again (see qda_dfu_delta_begin()).
+ *
+ * @param[in] qda    The QDA session.
+ * @param[in] enable Whether to skip unchanged blocks.
+ */
+void qda_set_delta(qda_t *qda, int enable);
+
+/**
+ * Check whether the device can skip DNLOAD blocks.
+ *
+ * This is the case when it writes every block at the offset given by its
+ * number (QDA_CAP_DELTA_DNLOAD), e.g., to resume a download.
+ *
+ * @param[in] qda The QDA session.
+ *
+ * @return 1 if blocks can be skipped, 0 otherwise.
+ */
+int qda_dfu_can_skip(const qda_t *qda);
+
+/**
+ * Start a delta download.
+ *
+ * @param[in] qda       The QDA session.
+ * @param[in] block_len The length of the DNLOAD blocks.
+ * @param[in] len       The length of the image to download.
+ *
+ * @return 1 if unchanged blocks can be skipped (see qda_dfu_unchanged()), 0
+ * 	   otherwise.
+ */
+int qda_dfu_delta_begin(qda_t *qda, uint16_t block_len, uint32_t len);
+
+/**
+ * Check whether a DNLOAD block is already on the device.
+ *
+ * The CRCs of the device blocks are read in batches, as needed. Blocks are
+ * assumed to be checked in order.
+ *
+ * @param[in] qda         The QDA session.
+ * @param[in] transaction The block number.
+ * @param[in] data        The data of the block.
+ * @param[in] len         The length of the block.
+ *
+ * @return 1 if the device holds the same data, 0 if it does not, negative
+ * 	   errno otherwise.
+ */
+int qda_dfu_unchanged(qda_t *qda, uint16_t transaction, const uint8_t *data,
+		      uint16_t len);
+
+/**
+ * Get the number of firmware bytes transferred so far.
+ *
+ * Only the data of successful DNLOAD / UPLOAD requests is counted, i.e., the
+ * goodput of the link.
+ *
+ * @param[in] qda The QDA session.
+ *
+ * @return The number of bytes.
+ */
+unsigned long qda_get_data_bytes(const qda_t *qda);
+
+/**
+ * Get the number of firmware bytes written with fill requests so far.
+ *
+ * These bytes do not cross the link (see qda_set_erased_value()), so they are
+ * not counted by qda_get_data_bytes().
+ *
+ * @param[in] qda The QDA session.
+ *
+ * @return The number of bytes.
+ */
+unsigned long qda_get_fill_bytes(const qda_t *qda);
+
+/**
+ * Print the statistics of the link with the device.
+ *
+ * Nothing is printed if the configuration has no report_stats() callback.
+ *
+ * @param[in] qda The QDA session.
+ */
+void qda_report_stats(qda_t *qda);
+
+/**
+ * Adapt the link with the device to its error rate.
+ *
+ * To be called between DNLOAD / UPLOAD blocks. Nothing is done if the
+ * configuration has no adapt() callback.
+ *
+ * @param[in] qda The QDA session.
+ *
+ * @return Error Status
+ * @retval 0 Success
+ * @retval -1 Error (the device does not answer anymore)
+ */
+int qda_adapt_link(qda_t *qda);
 
 /**
  * Retrieve state string.
@@ -239,27 +546,27 @@ const char *qda_dfu_state_to_string(int state);
 const char *qda_dfu_status_to_string(int status);
 
 /* DFU SHIM */
-#define dfu_detach(dev, interface, timeout) qda_dfu_detach()
+#define dfu_detach(dev, interface, timeout) qda_dfu_detach(dev)
 /*
  * In the following two macros we use the 'comma' operator and we cast
  * 'interface' to void to mark it as used and avoid compilation warnings about
  * unused variables.
  */
 #define dfu_download(dev, interface, len, trans, data)                         \
-	((void)interface, qda_dfu_download(len, trans, data))
+	((void)interface, qda_dfu_download(dev, len, trans, data))
 #define dfu_upload(dev, interface, len, trans, data)                           \
-	((void)interface, qda_dfu_upload(len, trans, data))
+	((void)interface, qda_dfu_upload(dev, len, trans, data))
 
-#define dfu_get_status(dif, status) qda_dfu_getstatus(status)
-#define dfu_clear_status(dev, interface) qda_dfu_getstate()
-#define dfu_abort(dev, interface) qda_dfu_abort()
+#define dfu_get_status(dif, status) qda_dfu_getstatus((dif)->dev_handle, status)
+#define dfu_clear_status(dev, interface) qda_dfu_getstate(dev)
+#define dfu_abort(dev, interface) qda_dfu_abort(dev)
 #define dfu_state_to_string(state) qda_dfu_state_to_string(state)
 #define dfu_status_to_string(status) qda_dfu_status_to_string(status)
 
 /* LIBUSB SHIM */
 #define libusb_set_interface_alt_setting(handle, interface, alt)               \
-	qda_set_alt_setting(alt)
-#define libusb_reset_device(ndle) qda_reset()
+	qda_set_alt_setting(handle, alt)
+#define libusb_reset_device(ndle) qda_reset(ndle)
 
 static inline uint16_t libusb_cpu_to_le16(const uint16_t x)
 {
@@ -0,0 +1,981 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "usb_dfu.h"
+#include "dfu_file.h"
+#include "qda_packets.h"
+#include "qda_device.h"
+#include "lz.h"
+
+/* XMODEM control bytes */
+#define SOH (0x01)
+#define STX (0x02)
+#define SOH_SHORT (0x03)
+#define EOT (0x04)
+#define ACK (0x06)
+#define NAK (0x15)
+#define CAN (0x18)
+
+/* XMODEM block sizes */
+#define BLOCK_SIZE (128)
+#define BLOCK_SIZE_1K (1024)
+
+/* Device timers, in microseconds */
+#define TIMEOUT_C (3000000)     /* Repeat 'C' while waiting for a request */
+#define TIMEOUT_FRAME (1000000) /* Give up on an incomplete frame */
+#define TIMEOUT_QUIET (2000)    /* Silence ending a drain after a bad frame */
+#define TIMEOUT_ACK (3000000)   /* Retransmit a frame / EOT */
+#define TIMEOUT_START (10000000) /* Give up waiting for the host's 'C' */
+#define TIMEOUT_SWITCH (20000)  /* Let the host change speed before a 'C' */
+
+/* Number of times a frame / EOT is sent before giving up */
+#define MAX_RETRANSMIT (10)
+
+/* Default flash size (Quark SE) and DFU transfer size */
+#define DEFAULT_FLASH_SIZE (384 * 1024)
+#define DEFAULT_XFER_SIZE (2048)
+#define MAX_XFER_SIZE (4096)
+
+/* Default highest UART speed */
+#define DEFAULT_MAX_BAUD (2000000)
+
+/* Size of a QDA message: a full DFU block plus headers and padding */
+#define MSG_SIZE (MAX_XFER_SIZE + 2 * BLOCK_SIZE_1K)
+
+/* Capabilities of the device model */
+#define DEVICE_CAPS \
+	(QDA_CAP_SHORT_FRAMES | QDA_CAP_TURNAROUND | QDA_CAP_LZ_DNLOAD | \
+	 QDA_CAP_DNLOAD_FILL | QDA_CAP_DELTA_DNLOAD | QDA_CAP_SET_BAUD)
+
+/* Size of the output queue */
+#define OUT_SIZE (4096)
+
+/* Activate debug messages by defining DEBUG_MSG to 1 */
+#define DEBUG_MSG (0)
+
+#if DEBUG_MSG
+#define printd(...) printf(__VA_ARGS__)
+#else
+#define printd(...)
+#endif
+
+/**
+ * XMODEM state of the device.
+ */
+typedef enum {
+	/* Receiving a request: waiting for SOH / STX / EOT, ignoring junk */
+	DEV_RX,
+	/* Receiving a request: in the middle of a frame */
+	DEV_RX_FRAME,
+	/* Receiving a request: dropping bytes until the line is quiet */
+	DEV_RX_DRAIN,
+	/* Sending a response: waiting for the host's 'C' */
+	DEV_TX_START,
+	/* Sending a response: waiting for the ACK of a frame */
+	DEV_TX_FRAME,
+	/* Sending a response: waiting for the ACK of the EOT */
+	DEV_TX_EOT,
+} dev_mode_t;
+
+struct qda_device {
+	/* Options */
+	int window;
+	int tx_1k;
+	/* Advertised capabilities; -1 if QDA_PKT_CAPS_REQ is not supported */
+	int64_t caps;
+	size_t flash_size;
+	uint16_t xfer_size;
+	uint32_t max_baud;
+	char *dump_path;
+
+	/* DFU state */
+	uint8_t *flash;
+	uint8_t state;
+	uint8_t status;
+
+	/* UART speed; 0 until it is changed */
+	uint32_t baud;
+	/* Speed to switch to once the response is sent, and how long to try it */
+	uint32_t next_baud;
+	uint32_t next_timeout_us;
+	/* Speed to go back to if no request comes before the deadline (if any) */
+	uint32_t old_baud;
+	uint64_t baud_deadline;
+
+	/* XMODEM state */
+	dev_mode_t mode;
+	uint64_t timer;
+	/* Current frame: received bytes / header size / payload size */
+	uint8_t frame[4 + BLOCK_SIZE_1K + 2];
+	size_t frame_len;
+	size_t frame_hdr;
+	size_t frame_size;
+	/* Whether the host knows about the extensions (it asked for them) */
+	int host_caps;
+	/* Next expected sequence number / sequence number being sent */
+	uint8_t seq;
+	/* Whether a frame has been received in the current transfer */
+	int started;
+	/* Whether a NAK has been sent since the last good frame (window) */
+	int nakked;
+	/* Remaining retransmissions of the frame being sent */
+	int retransmit;
+	/* Whether the byte being processed came alone (not within a burst) */
+	int rx_alone;
+
+	/* Request being received / response being sent */
+	uint8_t msg[MSG_SIZE];
+	size_t msg_len;
+	size_t msg_off;
+
+	/* Output queue */
+	uint8_t out[OUT_SIZE];
+	size_t out_len;
+};
+
+/*
+ * Bitwise CRC-16 CCITT (XMODEM flavor).
+ *
+ * This is deliberately the reference algorithm rather than the host's
+ * table-driven one, so that the two can be checked against each other.
+ */
+static uint16_t crc16(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= (uint16_t)*data++ << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+static void dev_put(qda_device_t *dev, const uint8_t *buf, size_t len)
+{
+	if (len > sizeof(dev->out) - dev->out_len) {
+		/* The host is not reading: the UART would overrun */
+		len = sizeof(dev->out) - dev->out_len;
+	}
+	memcpy(&dev->out[dev->out_len], buf, len);
+	dev->out_len += len;
+}
+
+static void dev_putc(qda_device_t *dev, uint8_t ch)
+{
+	dev_put(dev, &ch, 1);
+}
+
+/*
+ * Whether an extension can be used: the device supports it and the host knows
+ * about it.
+ */
+static int dev_has_cap(const qda_device_t *dev, uint32_t cap)
+{
+	return dev->host_caps && (dev->caps > 0) && (dev->caps & cap);
+}
+
+/*
+ * Reply to a frame: plain ACK / NAK, or followed by the sequence number the
+ * reply refers to in window mode.
+ */
+static void dev_reply(qda_device_t *dev, uint8_t cmd, uint8_t seq)
+{
+	dev_putc(dev, cmd);
+	if (dev_has_cap(dev, QDA_CAP_WINDOW)) {
+		dev_putc(dev, seq);
+	}
+}
+
+/*
+ * Start receiving a request.
+ */
+static void dev_start_rx(qda_device_t *dev, uint64_t now_us)
+{
+	dev->mode = DEV_RX;
+	dev->seq = 1;
+	dev->started = 0;
+	dev->next_baud = 0;
+	dev->nakked = 0;
+	dev->msg_len = 0;
+	dev_putc(dev, 'C');
+	dev->timer = now_us + TIMEOUT_C;
+}
+
+/*
+ * Switch to the speed asked for by QDA_PKT_SET_BAUD_REQ, its response having
+ * been sent.
+ *
+ * Reception starts as in dev_start_rx(), but the 'C' is only sent when the
+ * timer expires, so that the host has switched too.
+ */
+static void dev_switch_baud(qda_device_t *dev, uint64_t now_us)
+{
+	dev->old_baud = dev->baud;
+	dev->baud = dev->next_baud;
+	dev->baud_deadline = now_us + dev->next_timeout_us;
+	dev->next_baud = 0;
+	dev->mode = DEV_RX;
+	dev->seq = 1;
+	dev->started = 0;
+	dev->nakked = 0;
+	dev->msg_len = 0;
+	dev->timer = now_us + TIMEOUT_SWITCH;
+}
+
+/*
+ * Send the current frame of the response, or the EOT if the whole response
+ * has been sent.
+ */
+static void dev_send_frame(qda_device_t *dev, uint64_t now_us)
+{
+	uint8_t *f = dev->frame;
+	size_t left = dev->msg_len - dev->msg_off;
+	size_t pl_size;
+	size_t n;
+	uint16_t crc;
+
+	if (!left) {
+		dev->mode = DEV_TX_EOT;
+		dev_putc(dev, EOT);
+		dev->timer = now_us + TIMEOUT_ACK;
+		return;
+	}
+	pl_size = (dev->tx_1k && left >= BLOCK_SIZE_1K) ? BLOCK_SIZE_1K
+							: BLOCK_SIZE;
+	n = (left < pl_size) ? left : pl_size;
+	f[0] = (pl_size == BLOCK_SIZE_1K) ? STX : SOH;
+	f[1] = dev->seq;
+	f[2] = ~dev->seq;
+	dev->frame_hdr = 3;
+	if ((n < BLOCK_SIZE) && dev_has_cap(dev, QDA_CAP_SHORT_FRAMES)) {
+		f[0] = SOH_SHORT;
+		f[3] = n;
+		pl_size = n;
+		dev->frame_hdr = 4;
+	}
+	memcpy(&f[dev->frame_hdr], &dev->msg[dev->msg_off], n);
+	memset(&f[dev->frame_hdr + n], 0, pl_size - n);
+	/* The CRC covers the length byte of short frames too */
+	crc = crc16(&f[3], dev->frame_hdr - 3 + pl_size);
+	f[dev->frame_hdr + pl_size] = crc >> 8;
+	f[dev->frame_hdr + pl_size + 1] = crc & 0xFF;
+	dev->frame_size = pl_size;
+	dev->mode = DEV_TX_FRAME;
+	dev_put(dev, f, dev->frame_hdr + pl_size + 2);
+	dev->timer = now_us + TIMEOUT_ACK;
+}
+
+/*
+ * Compute the CRCs asked for by a QDA_DFU_CRC_REQ request.
+ *
+ * Only the blocks within the flash are given a CRC.
+ *
+ * @param[in]  dev  The device model.
+ * @param[in]  req  The request.
+ * @param[out] resp The response payload.
+ */
+static void dev_crcs(qda_device_t *dev, const crc_req_payload_t *req,
+		     crc_resp_payload_t *resp)
+{
+	size_t end = req->end < dev->flash_size ? req->end : dev->flash_size;
+	size_t off = (size_t)req->block_num * req->block_len;
+	uint16_t n;
+
+	for (n = 0; (n < req->count) && req->block_len && (off < end); n++) {
+		resp->crc[n] = ~dfu_file_crc(0xffffffff, &dev->flash[off],
+					     end - off < req->block_len
+						 ? end - off
+						 : req->block_len);
+		off += req->block_len;
+	}
+	resp->count = n;
+}
+
+/*
+ * Write the data of a DNLOAD request into the flash.
+ *
+ * @param[in] dev       The device model.
+ * @param[in] block_num The block number.
+ * @param[in] data      The data (compressed if comp_len is not 0), or NULL
+ * 			for a fill request.
+ * @param[in] len       The length of the (decompressed) data.
+ * @param[in] comp_len  The length of the compressed data, or the fill value
+ * 			if data is NULL.
+ */
+static void dev_dnload(qda_device_t *dev, uint16_t block_num,
+		       const uint8_t *data, size_t len, size_t comp_len)
+{
+	size_t off = (size_t)block_num * dev->xfer_size;
+
+	if (len == 0) {
+		/* End of the download: manifestation is immediate */
+		dev->state = DFU_STATE_dfuIDLE;
+	} else if ((len > dev->xfer_size) || (off + len > dev->flash_size)) {
+		dev->state = DFU_STATE_dfuERROR;
+		dev->status = DFU_STATUS_errADDRESS;
+	} else if (!data) {
+		memset(&dev->flash[off], comp_len, len);
+		dev->state = DFU_STATE_dfuDNLOAD_IDLE;
+	} else if (comp_len && (lz_decompress(data, comp_len, &dev->flash[off],
+					      len) != (int)len)) {
+		dev->state = DFU_STATE_dfuERROR;
+		dev->status = DFU_STATUS_errUNKNOWN;
+	} else {
+		if (!comp_len) {
+			memcpy(&dev->flash[off], data, len);
+		}
+		dev->state = DFU_STATE_dfuDNLOAD_IDLE;
+	}
+}
+
+/*
+ * Process a QDA request and prepare the response.
+ */
+static void dev_handle(qda_device_t *dev)
+{
+	qda_pkt_t *req = (qda_pkt_t *)dev->msg;
+	qda_pkt_t *resp = (qda_pkt_t *)dev->msg;
+	dnload_req_payload_t *dnload;
+	dnload_lz_req_payload_t *dnload_lz;
+	dnload_fill_req_payload_t *dnload_fill;
+	crc_req_payload_t crc_req;
+	crc_resp_payload_t *crc_resp;
+	upload_req_payload_t *upload;
+	upload_resp_payload_t *upload_resp;
+	dfu_desc_resp_payload_t *dfu_desc;
+	dev_desc_resp_payload_t *dev_desc;
+	get_status_resp_payload_t *get_status;
+	get_state_resp_payload_t *get_state;
+	caps_resp_payload_t *caps;
+	set_baud_req_payload_t *set_baud;
+	size_t req_len = dev->msg_len;
+	size_t off;
+	size_t len;
+	uint32_t type;
+
+	if (dev->msg_len < sizeof(*req)) {
+		type = 0;
+	} else {
+		type = req->type;
+	}
+	printd("qda_device: request 0x%08x\n", type);
+	/* A request came through: the current speed is fine */
+	dev->baud_deadline = 0;
+	dev->msg_len = sizeof(*resp);
+	switch (type) {
+	case QDA_PKT_RESET:
+	case QDA_PKT_DFU_SET_ALT_SETTING:
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DEV_DESC_REQ:
+		resp->type = QDA_PKT_DEV_DESC_RESP;
+		dev_desc = (dev_desc_resp_payload_t *)resp->payload;
+		dev_desc->id_vendor = 0x8086;
+		dev_desc->id_product = 0xC100;
+		dev_desc->bcd_device = 0;
+		dev->msg_len += sizeof(*dev_desc);
+		break;
+	case QDA_PKT_CAPS_REQ:
+		if (dev->caps < 0) {
+			/* Legacy device */
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		dev->host_caps = 1;
+		resp->type = QDA_PKT_CAPS_RESP;
+		caps = (caps_resp_payload_t *)resp->payload;
+		caps->caps = dev->caps;
+		dev->msg_len += sizeof(*caps);
+		break;
+	case QDA_PKT_SET_BAUD_REQ:
+		set_baud = (set_baud_req_payload_t *)req->payload;
+		if (!dev_has_cap(dev, QDA_CAP_SET_BAUD) ||
+		    (sizeof(*req) + sizeof(*set_baud) > req_len) ||
+		    !set_baud->baud || (set_baud->baud > dev->max_baud)) {
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		/* Switch once the response has been sent */
+		dev->next_baud = set_baud->baud;
+		dev->next_timeout_us = (uint32_t)set_baud->timeout_ms * 1000;
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DFU_DESC_REQ:
+		resp->type = QDA_PKT_DFU_DESC_RESP;
+		dfu_desc = (dfu_desc_resp_payload_t *)resp->payload;
+		dfu_desc->num_alt_settings = 1;
+		dfu_desc->bm_attributes = 0;
+		dfu_desc->detach_timeout = 0;
+		dfu_desc->transfer_size = dev->xfer_size;
+		dfu_desc->bcd_dfu_ver = 0x0101;
+		dev->msg_len += sizeof(*dfu_desc);
+		break;
+	case QDA_PKT_DFU_DNLOAD_REQ:
+		dnload = (dnload_req_payload_t *)req->payload;
+		if (sizeof(*req) + sizeof(*dnload) + dnload->data_len >
+		    req_len) {
+			/* Part of the request is missing */
+			dev->state = DFU_STATE_dfuERROR;
+			dev->status = DFU_STATUS_errUNKNOWN;
+		} else {
+			dev_dnload(dev, dnload->block_num, dnload->data,
+				   dnload->data_len, 0);
+		}
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DFU_DNLOAD_LZ_REQ:
+		if (!dev_has_cap(dev, QDA_CAP_LZ_DNLOAD)) {
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		dnload_lz = (dnload_lz_req_payload_t *)req->payload;
+		if (!dnload_lz->comp_len ||
+		    (sizeof(*req) + sizeof(*dnload_lz) + dnload_lz->comp_len >
+		     req_len)) {
+			dev->state = DFU_STATE_dfuERROR;
+			dev->status = DFU_STATUS_errUNKNOWN;
+		} else {
+			dev_dnload(dev, dnload_lz->block_num, dnload_lz->data,
+				   dnload_lz->data_len, dnload_lz->comp_len);
+		}
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DFU_DNLOAD_FILL_REQ:
+		if (!dev_has_cap(dev, QDA_CAP_DNLOAD_FILL)) {
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		dnload_fill = (dnload_fill_req_payload_t *)req->payload;
+		if (sizeof(*req) + sizeof(*dnload_fill) > req_len) {
+			dev->state = DFU_STATE_dfuERROR;
+			dev->status = DFU_STATUS_errUNKNOWN;
+		} else {
+			dev_dnload(dev, dnload_fill->block_num, NULL,
+				   dnload_fill->data_len, dnload_fill->value);
+		}
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DFU_CRC_REQ:
+		if (!dev_has_cap(dev, QDA_CAP_DELTA_DNLOAD) ||
+		    (sizeof(*req) + sizeof(crc_req) > req_len)) {
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		/* The request is overwritten by the response: copy it */
+		memcpy(&crc_req, req->payload, sizeof(crc_req));
+		if (crc_req.count > (MSG_SIZE - sizeof(*resp) -
+				     sizeof(*crc_resp)) / sizeof(uint32_t)) {
+			resp->type = QDA_PKT_STALL;
+			break;
+		}
+		resp->type = QDA_PKT_DFU_CRC_RESP;
+		crc_resp = (crc_resp_payload_t *)resp->payload;
+		dev_crcs(dev, &crc_req, crc_resp);
+		dev->msg_len += sizeof(*crc_resp) +
+				crc_resp->count * sizeof(crc_resp->crc[0]);
+		break;
+	case QDA_PKT_DFU_UPLOAD_REQ:
+		upload = (upload_req_payload_t *)req->payload;
+		len = upload->max_data_len;
+		off = (size_t)upload->block_num * len;
+		if (len > dev->xfer_size) {
+			len = dev->xfer_size;
+		}
+		if (off >= dev->flash_size) {
+			len = 0;
+		} else if (off + len > dev->flash_size) {
+			len = dev->flash_size - off;
+		}
+		dev->state = (len == upload->max_data_len)
+				 ? DFU_STATE_dfuUPLOAD_IDLE
+				 : DFU_STATE_dfuIDLE;
+		resp->type = QDA_PKT_DFU_UPLOAD_RESP;
+		upload_resp = (upload_resp_payload_t *)resp->payload;
+		/* The request is overwritten: do not use 'upload' anymore */
+		upload_resp->data_len = len;
+		memcpy(upload_resp->data, &dev->flash[off], len);
+		dev->msg_len += sizeof(*upload_resp) + len;
+		break;
+	case QDA_PKT_DFU_GETSTATUS_REQ:
+		resp->type = QDA_PKT_DFU_GETSTATUS_RESP;
+		get_status = (get_status_resp_payload_t *)resp->payload;
+		get_status->poll_timeout = 0;
+		get_status->status = dev->status;
+		get_status->state = dev->state;
+		dev->msg_len += sizeof(*get_status);
+		break;
+	case QDA_PKT_DFU_CLRSTATUS:
+	case QDA_PKT_DFU_ABORT:
+		dev->state = DFU_STATE_dfuIDLE;
+		dev->status = DFU_STATUS_OK;
+		resp->type = QDA_PKT_ACK;
+		break;
+	case QDA_PKT_DFU_GETSTATE_REQ:
+		resp->type = QDA_PKT_DFU_GETSTATE_RESP;
+		get_state = (get_state_resp_payload_t *)resp->payload;
+		get_state->state = dev->state;
+		dev->msg_len += sizeof(*get_state);
+		break;
+	default:
+		resp->type = QDA_PKT_STALL;
+		break;
+	}
+}
+
+/*
+ * Process a complete frame of a request.
+ */
+static void dev_rx_frame(qda_device_t *dev, uint64_t now_us)
+{
+	uint8_t *f = dev->frame;
+	size_t hdr = dev->frame_hdr;
+	size_t pl_size = dev->frame_size;
+	uint16_t crc = (f[hdr + pl_size] << 8) | f[hdr + pl_size + 1];
+	uint8_t seq = f[1];
+
+	dev->mode = DEV_RX;
+	dev->timer = now_us + TIMEOUT_C;
+	if ((seq != (~f[2] & 0xFF)) ||
+	    (crc != crc16(&f[3], hdr - 3 + pl_size))) {
+		printd("qda_device: corrupted frame\n");
+		if (!dev_has_cap(dev, QDA_CAP_WINDOW)) {
+			/*
+			 * The frame may have been misframed (e.g., a byte was
+			 * lost): wait for the rest of it, or of the host's
+			 * retransmission, to pass before asking for it again.
+			 */
+			dev->mode = DEV_RX_DRAIN;
+			dev->timer = now_us + TIMEOUT_QUIET;
+		} else if (!dev->nakked) {
+			dev_reply(dev, NAK, dev->seq);
+			dev->nakked = 1;
+		}
+		return;
+	}
+	if (seq == dev->seq) {
+		if (dev->msg_len + pl_size > sizeof(dev->msg)) {
+			dev_putc(dev, CAN);
+			dev->msg_len = 0;
+			return;
+		}
+		memcpy(&dev->msg[dev->msg_len], &f[hdr], pl_size);
+		dev->msg_len += pl_size;
+		dev->started = 1;
+		dev->nakked = 0;
+		dev_reply(dev, ACK, dev->seq);
+		dev->seq++;
+	} else if ((uint8_t)(dev->seq - seq) < 128) {
+		/* Duplicate of an already received frame */
+		dev_reply(dev, ACK, dev->seq - 1);
+	} else if (dev_has_cap(dev, QDA_CAP_WINDOW)) {
+		/* A frame has been lost: ask for it once */
+		if (!dev->nakked) {
+			dev_reply(dev, NAK, dev->seq);
+			dev->nakked = 1;
+		}
+	} else {
+		dev_putc(dev, CAN);
+	}
+}
+
+static void dev_rx_byte(qda_device_t *dev, uint8_t ch, uint64_t now_us);
+
+/*
+ * Drop a frame whose header is invalid: it was not a frame start. The bytes
+ * following the presumed start are scanned again for a real one.
+ */
+static void dev_rx_resync(qda_device_t *dev, uint64_t now_us)
+{
+	uint8_t hdr[4];
+	size_t len = dev->frame_len - 1;
+	size_t i;
+
+	memcpy(hdr, &dev->frame[1], len);
+	dev->mode = DEV_RX;
+	for (i = 0; i < len; i++) {
+		dev_rx_byte(dev, hdr[i], now_us);
+	}
+}
+
+/*
+ * Process a byte sent by the host.
+ */
+static void dev_rx_byte(qda_device_t *dev, uint8_t ch, uint64_t now_us)
+{
+	int turnaround;
+
+	switch (dev->mode) {
+	case DEV_RX:
+		if ((ch == SOH) || (ch == STX) ||
+		    ((ch == SOH_SHORT) && (dev->caps > 0) &&
+		     (dev->caps & QDA_CAP_SHORT_FRAMES))) {
+			dev->frame[0] = ch;
+			dev->frame_len = 1;
+			dev->frame_hdr = (ch == SOH_SHORT) ? 4 : 3;
+			/* The size of short frames is known with their header */
+			dev->frame_size = (ch == STX) ? BLOCK_SIZE_1K
+					  : (ch == SOH) ? BLOCK_SIZE
+					  : 0;
+			dev->mode = DEV_RX_FRAME;
+			dev->timer = now_us + TIMEOUT_FRAME;
+		} else if ((ch == EOT) && dev->started && dev->rx_alone) {
+			/*
+			 * An EOT within a burst of bytes is the payload of a
+			 * frame whose header was lost; the host repeats a real
+			 * one if it gets no ACK.
+			 */
+			/* Decided before the request can change it */
+			turnaround = dev_has_cap(dev, QDA_CAP_TURNAROUND);
+			dev_putc(dev, ACK);
+			dev_handle(dev);
+			dev->msg_off = 0;
+			dev->seq = 1;
+			dev->retransmit = MAX_RETRANSMIT;
+			if (turnaround) {
+				/* Answer right away, with no 'C' */
+				dev_send_frame(dev, now_us);
+				break;
+			}
+			dev->mode = DEV_TX_START;
+			dev->timer = now_us + TIMEOUT_START;
+		}
+		break;
+	case DEV_RX_FRAME:
+		dev->frame[dev->frame_len++] = ch;
+		if ((dev->frame_len == 3) && (dev->frame[1] != (~ch & 0xFF))) {
+			dev_rx_resync(dev, now_us);
+			break;
+		}
+		if ((dev->frame_len == 4) && (dev->frame[0] == SOH_SHORT)) {
+			if (!ch || (ch >= BLOCK_SIZE)) {
+				dev_rx_resync(dev, now_us);
+				break;
+			}
+			dev->frame_size = ch;
+		}
+		if (dev->frame_len == dev->frame_hdr + dev->frame_size + 2) {
+			dev_rx_frame(dev, now_us);
+		}
+		break;
+	case DEV_RX_DRAIN:
+		dev->timer = now_us + TIMEOUT_QUIET;
+		break;
+	case DEV_TX_START:
+		if (ch == 'C') {
+			dev_send_frame(dev, now_us);
+		}
+		break;
+	case DEV_TX_FRAME:
+	case DEV_TX_EOT:
+		if (ch == ACK) {
+			if (dev->mode == DEV_TX_EOT) {
+				if (dev->next_baud) {
+					dev_switch_baud(dev, now_us);
+					break;
+				}
+				dev_start_rx(dev, now_us);
+				break;
+			}
+			dev->msg_off += dev->frame_size;
+			if (dev->msg_off > dev->msg_len) {
+				dev->msg_off = dev->msg_len;
+			}
+			dev->seq++;
+			dev->retransmit = MAX_RETRANSMIT;
+			dev_send_frame(dev, now_us);
+		} else if ((ch == NAK) || (ch == 'C')) {
+			if (!dev->retransmit--) {
+				dev_start_rx(dev, now_us);
+				break;
+			}
+			dev_send_frame(dev, now_us);
+		} else if (ch == CAN) {
+			dev_start_rx(dev, now_us);
+		}
+		break;
+	}
+}
+
+void qda_device_input(qda_device_t *dev, const uint8_t *buf, size_t len,
+		      uint64_t now_us)
+{
+	dev->rx_alone = (len == 1);
+	while (len--) {
+		dev_rx_byte(dev, *buf++, now_us);
+	}
+}
+
+uint64_t qda_device_next_timer(const qda_device_t *dev)
+{
+	if (dev->baud_deadline && (dev->baud_deadline < dev->timer)) {
+		return dev->baud_deadline;
+	}
+
+	return dev->timer;
+}
+
+void qda_device_poll(qda_device_t *dev, uint64_t now_us)
+{
+	if (dev->baud_deadline && (now_us >= dev->baud_deadline)) {
+		/* The host could not talk at the new speed: go back */
+		printd("qda_device: back to %u baud\n", dev->old_baud);
+		dev->baud = dev->old_baud;
+		dev->baud_deadline = 0;
+		dev_start_rx(dev, now_us);
+		return;
+	}
+	if (now_us < dev->timer) {
+		return;
+	}
+	switch (dev->mode) {
+	case DEV_RX:
+		if (dev->started) {
+			/* The host went silent in the middle of a transfer */
+			dev_reply(dev, NAK, dev->seq);
+			dev->timer = now_us + TIMEOUT_C;
+		} else {
+			dev_start_rx(dev, now_us);
+		}
+		break;
+	case DEV_RX_FRAME:
+	case DEV_RX_DRAIN:
+		dev->mode = DEV_RX;
+		if (dev->started) {
+			dev_reply(dev, NAK, dev->seq);
+			dev->nakked = 1;
+			dev->timer = now_us + TIMEOUT_C;
+		} else {
+			dev_start_rx(dev, now_us);
+		}
+		break;
+	case DEV_TX_START:
+		dev_start_rx(dev, now_us);
+		break;
+	case DEV_TX_FRAME:
+	case DEV_TX_EOT:
+		if (!dev->retransmit--) {
+			dev_start_rx(dev, now_us);
+			break;
+		}
+		if (dev->mode == DEV_TX_EOT) {
+			dev_putc(dev, EOT);
+			dev->timer = now_us + TIMEOUT_ACK;
+		} else {
+			dev_send_frame(dev, now_us);
+		}
+		break;
+	}
+}
+
+size_t qda_device_output(qda_device_t *dev, uint8_t *buf, size_t len)
+{
+	if (len > dev->out_len) {
+		len = dev->out_len;
+	}
+	memcpy(buf, dev->out, len);
+	memmove(dev->out, &dev->out[len], dev->out_len - len);
+	dev->out_len -= len;
+
+	return len;
+}
+
+void qda_device_reset(qda_device_t *dev, uint64_t now_us)
+{
+	dev->state = DFU_STATE_dfuIDLE;
+	dev->status = DFU_STATUS_OK;
+	dev->out_len = 0;
+	dev->host_caps = 0;
+	dev->baud = 0;
+	dev->baud_deadline = 0;
+	dev_start_rx(dev, now_us);
+}
+
+uint32_t qda_device_get_baud(const qda_device_t *dev)
+{
+	return dev->baud;
+}
+
+/*
+ * Parse a numeric option value.
+ */
+static int parse_size(const char *val, size_t min, size_t max, size_t *out)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(val, &end, 0);
+	if ((end == val) || ((*end != '\0') && (*end != ',')) || (v < min) ||
+	    (v > max)) {
+		return -1;
+	}
+	*out = v;
+
+	return 0;
+}
+
+/*
+ * Duplicate an option value (up to the next ',').
+ */
+static char *dup_value(const char *val)
+{
+	size_t len = strcspn(val, ",");
+	char *s = malloc(len + 1);
+
+	if (s) {
+		memcpy(s, val, len);
+		s[len] = '\0';
+	}
+
+	return s;
+}
+
+static int dev_parse_options(qda_device_t *dev, const char *opt,
+			     char **load_path)
+{
+	size_t v;
+
+	while (opt && *opt) {
+		if (!strncmp(opt, "window", 6) &&
+		    ((opt[6] == ',') || (opt[6] == '\0'))) {
+			dev->window = 1;
+		} else if (!strncmp(opt, "1k", 2) &&
+			   ((opt[2] == ',') || (opt[2] == '\0'))) {
+			dev->tx_1k = 1;
+		} else if (!strncmp(opt, "legacy", 6) &&
+			   ((opt[6] == ',') || (opt[6] == '\0'))) {
+			dev->caps = -1;
+		} else if (!strncmp(opt, "caps=", 5)) {
+			if (parse_size(opt + 5, 0, UINT32_MAX, &v) < 0) {
+				return -1;
+			}
+			dev->caps = v;
+		} else if (!strncmp(opt, "flash=", 6)) {
+			if (parse_size(opt + 6, 1, 64 * 1024 * 1024, &v) < 0) {
+				return -1;
+			}
+			dev->flash_size = v;
+		} else if (!strncmp(opt, "xfer=", 5)) {
+			if (parse_size(opt + 5, 1, MAX_XFER_SIZE, &v) < 0) {
+				return -1;
+			}
+			dev->xfer_size = v;
+		} else if (!strncmp(opt, "maxbaud=", 8)) {
+			if (parse_size(opt + 8, 1, UINT32_MAX, &v) < 0) {
+				return -1;
+			}
+			dev->max_baud = v;
+		} else if (!strncmp(opt, "load=", 5)) {
+			free(*load_path);
+			*load_path = dup_value(opt + 5);
+		} else if (!strncmp(opt, "dump=", 5)) {
+			free(dev->dump_path);
+			dev->dump_path = dup_value(opt + 5);
+		} else {
+			return -1;
+		}
+		opt = strchr(opt, ',');
+		if (opt) {
+			opt++;
+		}
+	}
+
+	return 0;
+}
+
+qda_device_t *qda_device_create(const char *options)
+{
+	qda_device_t *dev;
+	char *load_path = NULL;
+	FILE *f;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		return NULL;
+	}
+	dev->caps = DEVICE_CAPS;
+	dev->flash_size = DEFAULT_FLASH_SIZE;
+	dev->xfer_size = DEFAULT_XFER_SIZE;
+	dev->max_baud = DEFAULT_MAX_BAUD;
+	if (dev_parse_options(dev, options, &load_path) < 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if (dev->window && (dev->caps > 0)) {
+		dev->caps |= QDA_CAP_WINDOW;
+	}
+	dev->flash = malloc(dev->flash_size);
+	if (!dev->flash) {
+		goto fail;
+	}
+	/* Erased flash */
+	memset(dev->flash, 0xFF, dev->flash_size);
+	if (load_path) {
+		f = fopen(load_path, "rb");
+		if (!f) {
+			goto fail;
+		}
+		fread(dev->flash, 1, dev->flash_size, f);
+		fclose(f);
+		free(load_path);
+		load_path = NULL;
+	}
+	qda_device_reset(dev, 0);
+
+	return dev;
+
+fail:
+	free(load_path);
+	free(dev->dump_path);
+	free(dev->flash);
+	free(dev);
+
+	return NULL;
+}
+
+int qda_device_destroy(qda_device_t *dev)
+{
+	int ret = 0;
+	FILE *f;
+
+	if (dev->dump_path) {
+		f = fopen(dev->dump_path, "wb");
+		if (!f ||
+		    (fwrite(dev->flash, 1, dev->flash_size, f) !=
+		     dev->flash_size)) {
+			ret = -1;
+		}
+		if (f && fclose(f)) {
+			ret = -1;
+		}
+	}
+	free(dev->dump_path);
+	free(dev->flash);
+	free(dev);
+
+	return ret;
+}
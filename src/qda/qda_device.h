@@ -0,0 +1,135 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _QDA_DEVICE_H_
+#define _QDA_DEVICE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * @defgroup groupQDADevice QDA device model
+ *
+ * A model of a QDA device (XMODEM receiver / sender plus DFU state machine,
+ * backed by an in-memory flash), used by the loopback transport.
+ *
+ * The model is event driven: it reacts to the bytes written by the host and
+ * to the expiration of its own timers, and queues the bytes it sends back.
+ * Time is whatever clock the caller passes in, in microseconds.
+ * @{
+ */
+
+/** A QDA device model (opaque). */
+typedef struct qda_device qda_device_t;
+
+/**
+ * Create a device model.
+ *
+ * The options are a comma-separated list of:
+ * - "window": support windowed XMODEM transmission (QDA_CAP_WINDOW): once
+ *   the host has queried the capabilities, follow every ACK / NAK with the
+ *   sequence number it refers to (see xmodem_set_window());
+ * - "1k": send responses in XMODEM-1K frames;
+ * - "caps=<mask>": advertised capabilities (QDA_CAP_*, default all the
+ *   supported ones);
+ * - "legacy": behave as a device not supporting QDA_PKT_CAPS_REQ;
+ * - "flash=<bytes>": size of the flash (default 384 KiB);
+ * - "xfer=<bytes>": DFU transfer size (default 2048);
+ * - "maxbaud=<baud>": highest UART speed accepted (default 2000000);
+ * - "load=<file>": initial content of the flash (erased otherwise);
+ * - "dump=<file>": file where to save the flash content on destruction.
+ *
+ * @param[in] options The options (may be NULL or empty).
+ *
+ * @return The device model or NULL on error (check errno).
+ */
+qda_device_t *qda_device_create(const char *options);
+
+/**
+ * Destroy a device model, saving its flash if required.
+ *
+ * @param[in] dev The device model.
+ *
+ * @return 0 on success, -1 if the flash could not be saved.
+ */
+int qda_device_destroy(qda_device_t *dev);
+
+/**
+ * Reset the device model into DFU mode (i.e., detach it).
+ *
+ * @param[in] dev    The device model.
+ * @param[in] now_us The current time.
+ */
+void qda_device_reset(qda_device_t *dev, uint64_t now_us);
+
+/**
+ * Feed the device model with bytes sent by the host.
+ *
+ * The bytes are a burst, received back to back: a lone control byte (e.g., an
+ * EOT) is only recognized as such if it comes in a burst of its own.
+ *
+ * @param[in] dev    The device model.
+ * @param[in] buf    The bytes.
+ * @param[in] len    The number of bytes.
+ * @param[in] now_us The time the bytes have been received.
+ */
+void qda_device_input(qda_device_t *dev, const uint8_t *buf, size_t len,
+		      uint64_t now_us);
+
+/**
+ * Get the time the next timer of the device model expires.
+ *
+ * @param[in] dev The device model.
+ *
+ * @return The expiration time or UINT64_MAX if no timer is running.
+ */
+uint64_t qda_device_next_timer(const qda_device_t *dev);
+
+/**
+ * Run the timers of the device model that expired.
+ *
+ * @param[in] dev    The device model.
+ * @param[in] now_us The current time.
+ */
+void qda_device_poll(qda_device_t *dev, uint64_t now_us);
+
+/**
+ * Get the current UART speed of the device model.
+ *
+ * @param[in] dev The device model.
+ *
+ * @return The speed in baud, or 0 if it is still the initial one.
+ */
+uint32_t qda_device_get_baud(const qda_device_t *dev);
+
+/**
+ * Take the bytes the device model sent to the host.
+ *
+ * @param[in]  dev The device model.
+ * @param[out] buf Where to store the bytes.
+ * @param[in]  len The size of the buffer.
+ *
+ * @return The number of bytes stored.
+ */
+size_t qda_device_output(qda_device_t *dev, uint8_t *buf, size_t len);
+
+/**
+ * @}
+ */
+
+#endif /* _QDA_DEVICE_H_ */
@@ -30,6 +30,8 @@ typedef enum {
 	/* Host requests */
 	QDA_PKT_RESET = 0x4D550000,
 	QDA_PKT_DEV_DESC_REQ = 0x4D550005,
+	QDA_PKT_CAPS_REQ = 0x4D550006,
+	QDA_PKT_SET_BAUD_REQ = 0x4D550007,
 	QDA_PKT_DFU_DESC_REQ = 0x4D5501FF,
 	QDA_PKT_DFU_SET_ALT_SETTING = 0x4D5501FE,
 	QDA_PKT_DFU_DETACH = 0x4D550100,
@@ -39,19 +41,62 @@ typedef enum {
 	QDA_PKT_DFU_CLRSTATUS = 0x4D550104,
 	QDA_PKT_DFU_GETSTATE_REQ = 0x4D550105,
 	QDA_PKT_DFU_ABORT = 0x4D550106,
+	QDA_PKT_DFU_DNLOAD_LZ_REQ = 0x4D550107,
+	QDA_PKT_DFU_DNLOAD_FILL_REQ = 0x4D550108,
+	QDA_PKT_DFU_CRC_REQ = 0x4D550109,
 	/* Device responses */
 	QDA_PKT_ATTACH = 0x4D558001,
 	QDA_PKT_DETACH = 0x4D558002,
 	QDA_PKT_ACK = 0x4D558003,
 	QDA_PKT_STALL = 0x4D558004,
 	QDA_PKT_DEV_DESC_RESP = 0x4D558005,
+	QDA_PKT_CAPS_RESP = 0x4D558006,
 	QDA_PKT_DFU_DESC_RESP = 0x4D5581FF,
 	QDA_PKT_DFU_UPLOAD_RESP = 0x4D558102,
 	QDA_PKT_DFU_GETSTATUS_RESP = 0x4D558103,
 	QDA_PKT_DFU_GETSTATE_RESP = 0x4D558105,
+	QDA_PKT_DFU_CRC_RESP = 0x4D558109,
 
 } qda_pkt_type_t;
 
+/**
+ * QDA capabilities (protocol extensions supported by the device)
+ *
+ * Devices not knowing QDA_PKT_CAPS_REQ reply with a STALL, i.e., no
+ * capability.
+ */
+/** The device accepts and sends XMODEM short frames. */
+#define QDA_CAP_SHORT_FRAMES (1 << 0)
+/**
+ * The device starts sending its response as soon as it has acknowledged the
+ * EOT of the request, without waiting for a 'C'.
+ */
+#define QDA_CAP_TURNAROUND (1 << 1)
+/** The device accepts compressed DNLOAD requests (QDA_DNLOAD_LZ_REQ). */
+#define QDA_CAP_LZ_DNLOAD (1 << 2)
+/**
+ * The device accepts DNLOAD requests filling a block with a single value
+ * (QDA_DNLOAD_FILL_REQ).
+ */
+#define QDA_CAP_DNLOAD_FILL (1 << 3)
+/**
+ * The device answers block CRC queries (QDA_DFU_CRC_REQ) and writes every
+ * DNLOAD block at the offset given by its block number, so that unchanged
+ * blocks can be left out of a download.
+ */
+#define QDA_CAP_DELTA_DNLOAD (1 << 4)
+/**
+ * The device can change the speed of its UART (QDA_SET_BAUD_REQ), going back
+ * to the previous one if no request comes at the new speed.
+ */
+#define QDA_CAP_SET_BAUD (1 << 5)
+/**
+ * The device follows every ACK / NAK of a request frame with the sequence
+ * number it refers to, so that the host can send several frames without
+ * waiting for each ACK (see xmodem_set_window()).
+ */
+#define QDA_CAP_WINDOW (1 << 6)
+
 /**
  * Generic QDA Packet structure
  */
@@ -69,6 +114,65 @@ typedef struct __ATTR_PACKED__ {
 	uint8_t data[];
 } dnload_req_payload_t;
 
+/**
+ * QDA_DNLOAD_LZ_REQ payload structure
+ *
+ * Same as QDA_DNLOAD_REQ, but the data is compressed (LZ4 block format, see
+ * lz.h); data_len is the length of the decompressed data.
+ */
+typedef struct __ATTR_PACKED__ {
+	uint16_t data_len;
+	uint16_t block_num;
+	uint16_t comp_len;
+	uint8_t data[];
+} dnload_lz_req_payload_t;
+
+/**
+ * QDA_DNLOAD_FILL_REQ payload structure
+ *
+ * Same as QDA_DNLOAD_REQ, but the block is data_len bytes of a single value
+ * (typically the erased value of the flash) rather than transmitted data.
+ */
+typedef struct __ATTR_PACKED__ {
+	uint16_t data_len;
+	uint16_t block_num;
+	uint8_t value;
+} dnload_fill_req_payload_t;
+
+/**
+ * QDA_DFU_CRC_REQ payload structure
+ *
+ * Ask for the CRC-32 (as in the DFU suffix) of 'count' blocks of 'block_len'
+ * bytes of the flash, starting at block 'block_num'. The blocks are cut at
+ * byte 'end' (i.e., the last block may be shorter).
+ */
+typedef struct __ATTR_PACKED__ {
+	uint16_t block_num;
+	uint16_t count;
+	uint16_t block_len;
+	uint32_t end;
+} crc_req_payload_t;
+
+/**
+ * QDA_DFU_CRC_RESP payload structure
+ */
+typedef struct __ATTR_PACKED__ {
+	uint16_t count;
+	uint32_t crc[];
+} crc_resp_payload_t;
+
+/**
+ * QDA_SET_BAUD_REQ payload structure
+ *
+ * The device acknowledges the request at the current speed and switches to
+ * 'baud' once the response has been sent. It goes back to the current speed
+ * unless it gets a complete request within 'timeout_ms'.
+ */
+typedef struct __ATTR_PACKED__ {
+	uint32_t baud;
+	uint16_t timeout_ms;
+} set_baud_req_payload_t;
+
 /**
  * QDA_UPLOAD_REQ payload structure
  */
@@ -101,6 +205,13 @@ typedef struct __ATTR_PACKED__ {
 	uint16_t bcd_device;
 } dev_desc_resp_payload_t;
 
+/**
+ * QDA_CAPS_RESP payload structure
+ */
+typedef struct __ATTR_PACKED__ {
+	uint32_t caps;
+} caps_resp_payload_t;
+
 /**
  * QDA_DFU_DESC_RESP payload structure
  */
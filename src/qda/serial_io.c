@@ -16,6 +16,9 @@
  * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -24,69 +27,435 @@
 #include <termio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #include "xmodem.h"
+#include "serial_io.h"
+#ifdef HAVE_SERIAL_IO_BOTHER
+#include "serial_io_bother.h"
+#endif
+
+/* Latency timer of USB-serial adapters in low-latency mode, in milliseconds */
+#define SERIAL_IO_LATENCY_TIMER_MS (1)
+
+/*
+ * A serial port.
+ */
+struct serial_io {
+	int handle;
+	struct termios tio_initial;
+	transport_stats_t stats;
+	/* Time the port was opened, in microseconds */
+	uint64_t open_time_us;
+	/* Receive timeout in milliseconds; set by serial_io_set_deadline() */
+	int rx_timeout_ms;
+	/* Baud rate of the serial port */
+	int link_speed;
+	/* Whether RTS/CTS flow control is enabled */
+	int rtscts;
+	/* Initial low-latency flag of the driver (-1: not changed) */
+	int low_latency_initial;
+	/* sysfs file of the latency timer of a USB-serial adapter (or NULL), and
+	 * its initial value in milliseconds (-1: not changed) */
+	char *latency_timer;
+	int latency_timer_initial;
+	/* The initial value formatted for sysfs, written back by
+	 * serial_io_restore() */
+	char latency_timer_restore[16];
+	/* Next open port, for the signal handler */
+	struct serial_io *next;
+};
 
-static int serial_handle;
-static struct termios tio_initial;
+/* The ports currently open, restored by the signal handler */
+static serial_io_t *open_ports;
 
 static void _signal_handler(int sig);
+static int serial_io_close(void *ctx);
 
-void xmodem_putc(uint8_t *ch)
+/*
+ * Get the current time of the monotonic clock, in microseconds.
+ */
+static uint64_t monotonic_us(void)
 {
-	size_t size = write(serial_handle, ch, 1);
-	(void)size;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
- * Get a character from the XMODEM I/O layer.
- *
- * This function must be blocking, but is also expected to timeout after a
- * certain amount of time. Moreover, in case of error, the function must not
- * set the output parameter (i.e., the pointed variable must remain unchanged).
+ * Get the current time of the monotonic clock, in milliseconds.
+ */
+static int64_t monotonic_ms(void)
+{
+	return monotonic_us() / 1000;
+}
+
+static uint64_t serial_io_get_time_us(void *ctx)
+{
+	(void)ctx;
+
+	return monotonic_us();
+}
+
+/*
+ * Get the time needed to transmit some bytes at the current baud rate (8n1,
+ * i.e., 10 bits per byte), in microseconds.
+ */
+static uint32_t serial_io_tx_time_us(void *ctx, size_t len)
+{
+	serial_io_t *sio = ctx;
+
+	return sio->link_speed
+		   ? (uint64_t)len * 10 * 1000000 / sio->link_speed
+		   : 0;
+}
+
+/*
+ * Write a scatter-gather list (typically a whole XMODEM frame).
  *
- * @param[out] ch A pointer to the variable where to store the read character.
- * 		  In case of error, the current value of the pointed variable
- * 		  is not modified.
+ * The list is handed to the driver with a single writev() call, unless the
+ * driver accepts only part of it.
  *
  * @return 0 on success, negative error code otherwise.
+ * @retval -EIO in case of I/O error.
+ */
+static int serial_io_writev(void *ctx, const transport_iovec_t *iov,
+			    int iovcnt)
+{
+	serial_io_t *sio = ctx;
+	struct iovec vec[XMODEM_MAX_IOV + 3];
+	struct iovec *cur = vec;
+	ssize_t retv;
+	int i;
+
+	if (iovcnt > (int)(sizeof(vec) / sizeof(vec[0]))) {
+		return -EINVAL;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	while (iovcnt) {
+		sio->stats.syscalls++;
+		retv = writev(sio->handle, cur, iovcnt);
+		if (retv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -EIO;
+		}
+		sio->stats.tx_bytes += retv;
+		/* Skip what has been written, resuming partial segments */
+		while (iovcnt && ((size_t)retv >= cur->iov_len)) {
+			retv -= cur->iov_len;
+			cur++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			cur->iov_base = (uint8_t *)cur->iov_base + retv;
+			cur->iov_len -= retv;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read the bytes available on the serial port.
+ *
+ * If the driver has no data, poll() is used to wait for some until an
+ * absolute deadline (on the monotonic clock) expires.
+ *
+ * @return Number of bytes read or negative error code.
  * @retval -ETIMEDOUT in case of timeout.
  * @retval -EIO   in case of I/O error.
  */
-int xmodem_getc(uint8_t *ch)
+static int serial_io_read(void *ctx, uint8_t *buf, size_t len)
 {
+	serial_io_t *sio = ctx;
+	struct pollfd pfd;
+	int64_t deadline;
+	int64_t now;
 	ssize_t retv;
 
-	retv = read(serial_handle, ch, 1);
-
-	switch (retv) {
-		case 1:
-			/* We read one character as expected: success */
-			return 0;
-		case 0:
-			/* We read 0 characters: we timed out */
+	deadline = monotonic_ms() + sio->rx_timeout_ms;
+	pfd.fd = sio->handle;
+	pfd.events = POLLIN;
+	do {
+		now = monotonic_ms();
+		sio->stats.syscalls++;
+		retv = poll(&pfd, 1, (now < deadline) ? deadline - now : 0);
+		if (retv == 0) {
+			/* Nothing arrived before the deadline */
 			return -ETIMEDOUT;
-		default:
-			/* Error or unexpected value: generic I/O error */
+		}
+		if (retv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
 			return -EIO;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			return -EIO;
+		}
+		/*
+		 * With VMIN = VTIME = 0, read() does not block and returns all
+		 * the bytes the driver has at this moment.
+		 */
+		sio->stats.syscalls++;
+		retv = read(sio->handle, buf, len);
+		if ((retv < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+			/* Error: generic I/O error */
+			return -EIO;
+		}
+	} while (retv <= 0);
+	sio->stats.rx_bytes += retv;
+
+	return retv;
+}
+
+static int serial_io_set_deadline(void *ctx, int ms)
+{
+	serial_io_t *sio = ctx;
+
+	/* Only used for the next deadlines: no need to touch the driver */
+	sio->rx_timeout_ms = ms;
+
+	return 0;
+}
+
+/*
+ * Release a serial port that could not be configured.
+ */
+static serial_io_t *serial_io_abort_open(serial_io_t *sio)
+{
+	int err = errno;
 
+	if (sio->handle != -1) {
+		close(sio->handle);
 	}
+	free(sio->latency_timer);
+	free(sio);
+	errno = err;
+
+	return NULL;
 }
 
-int xmodem_set_timeout(int ms)
+/*
+ * Standard baud rates, as defined by the C library.
+ */
+static const struct {
+	int speed;
+	speed_t code;
+} serial_speeds[] = {
+	{1200, B1200},       {2400, B2400},       {4800, B4800},
+	{9600, B9600},       {19200, B19200},     {38400, B38400},
+	{57600, B57600},     {115200, B115200},
+#ifdef B230400
+	{230400, B230400},
+#endif
+#ifdef B460800
+	{460800, B460800},
+#endif
+#ifdef B500000
+	{500000, B500000},
+#endif
+#ifdef B576000
+	{576000, B576000},
+#endif
+#ifdef B921600
+	{921600, B921600},
+#endif
+#ifdef B1000000
+	{1000000, B1000000},
+#endif
+#ifdef B1152000
+	{1152000, B1152000},
+#endif
+#ifdef B1500000
+	{1500000, B1500000},
+#endif
+#ifdef B2000000
+	{2000000, B2000000},
+#endif
+#ifdef B2500000
+	{2500000, B2500000},
+#endif
+#ifdef B3000000
+	{3000000, B3000000},
+#endif
+#ifdef B3500000
+	{3500000, B3500000},
+#endif
+#ifdef B4000000
+	{4000000, B4000000},
+#endif
+};
+
+/*
+ * Get the termios code of a standard baud rate.
+ *
+ * @return The code, or B0 if the rate is not a standard one.
+ */
+static speed_t serial_io_speed(int speed)
 {
-	struct termios tio;
-	if(tcgetattr(serial_handle, &tio) < 0)
-	   return -1;
+	size_t i;
+
+	for (i = 0; i < sizeof(serial_speeds) / sizeof(serial_speeds[0]); i++) {
+		if (serial_speeds[i].speed == speed) {
+			return serial_speeds[i].code;
+		}
+	}
+
+	return B0;
+}
+
+/*
+ * Apply a configuration to a port, with the given speed.
+ *
+ * @param[in] handle The port.
+ * @param[in] tio    The configuration (its speed is overwritten).
+ * @param[in] speed  The speed, in baud.
+ * @param[in] when   When to apply it (TCSANOW, TCSADRAIN).
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int serial_io_apply(int handle, struct termios *tio, int speed,
+			   int when)
+{
+	speed_t code = serial_io_speed(speed);
 
-	tio.c_cc[VTIME] = ms / 100;
-	return tcsetattr(serial_handle, TCSANOW, &tio);
+	if (code == B0) {
+#ifdef HAVE_SERIAL_IO_BOTHER
+		/* Any other rate is set with BOTHER once the port is set up */
+		code = B38400;
+#else
+		errno = EINVAL;
+		return -1;
+#endif
+	}
+	cfsetospeed(tio, code);
+	cfsetispeed(tio, code);
+	if (tcsetattr(handle, when, tio) < 0) {
+		return -1;
+	}
+#ifdef HAVE_SERIAL_IO_BOTHER
+	if ((serial_io_speed(speed) == B0) &&
+	    (serial_io_set_custom_speed(handle, speed) < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+#endif
+
+	return 0;
 }
 
-int serial_io_open(char *path, int speed)
+#ifdef __linux__
+/*
+ * Find the latency timer of a USB-serial adapter (e.g., FTDI) in sysfs.
+ *
+ * @return The path of its sysfs file (to be freed), or NULL if the port has
+ * 	   none.
+ */
+static char *serial_io_find_latency_timer(const char *path)
 {
+	char real[PATH_MAX];
+	const char *name;
+	char *timer;
+
+	/* Resolve links such as /dev/serial/by-id/... to the TTY name */
+	if (!realpath(path, real)) {
+		return NULL;
+	}
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+	timer = malloc(strlen(name) +
+		       sizeof("/sys/class/tty//device/latency_timer"));
+	if (!timer) {
+		return NULL;
+	}
+	sprintf(timer, "/sys/class/tty/%s/device/latency_timer", name);
+	if (access(timer, F_OK)) {
+		free(timer);
+		return NULL;
+	}
+
+	return timer;
+}
+
+/*
+ * Read or write the latency timer of a USB-serial adapter.
+ *
+ * @param[in] timer The sysfs file of the latency timer.
+ * @param[in] ms    The value to write, in milliseconds, or -1 to read it.
+ *
+ * @return The value read (or 0 if written), -1 on error (check errno).
+ */
+static int serial_io_latency_timer(const char *timer, int ms)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(timer, (ms < 0) ? "r" : "w");
+	if (!f) {
+		return -1;
+	}
+	if (ms < 0) {
+		ret = (fscanf(f, "%d", &ms) == 1) ? ms : -1;
+	} else {
+		ret = (fprintf(f, "%d\n", ms) < 0) ? -1 : 0;
+	}
+	if (fclose(f)) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Set or clear the low-latency flag of the driver.
+ *
+ * @param[in]  handle  The port.
+ * @param[in]  enable  Non-zero to set the flag, 0 to clear it.
+ * @param[out] initial Where to store the previous state of the flag (0 or 1);
+ * 		       may be NULL.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int serial_io_apply_low_latency(int handle, int enable, int *initial)
+{
+	struct serial_struct ss;
+
+	if (ioctl(handle, TIOCGSERIAL, &ss) < 0) {
+		return -1;
+	}
+	if (initial) {
+		*initial = !!(ss.flags & ASYNC_LOW_LATENCY);
+	}
+	if (enable) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+	}
+
+	return ioctl(handle, TIOCSSERIAL, &ss);
+}
+#endif /* __linux__ */
+
+static void *serial_io_open(const char *path, int speed)
+{
+	serial_io_t *sio;
 	struct termios tio;
 	memset(&tio, 0, sizeof(tio));
 	tio.c_iflag = 0;
@@ -94,85 +463,199 @@ int serial_io_open(char *path, int speed)
 	/* 8n1, see termios.h for more information */
 	tio.c_cflag = CS8 | CREAD | CLOCAL;
 	tio.c_lflag = 0;
+	/* Non-blocking reads: timeouts are handled with poll() deadlines */
 	tio.c_cc[VMIN] = 0;
-	/* Set 3s as a standart value. Will be set by xmodem_set_timeout before
-	 * each run. */
-	tio.c_cc[VTIME] = 30;
+	tio.c_cc[VTIME] = 0;
+
+	sio = calloc(1, sizeof(*sio));
+	if (!sio) {
+		return NULL;
+	}
+	sio->rx_timeout_ms = 3000;
+	sio->open_time_us = monotonic_us();
+	sio->low_latency_initial = -1;
+	sio->latency_timer_initial = -1;
 
-	serial_handle = open(path, O_RDWR | O_NOCTTY);
+	sio->handle = open(path, O_RDWR | O_NOCTTY);
 
 	/* Check if file is open */
-	if (serial_handle == -1) {
-		return -1;
+	if (sio->handle == -1) {
+		return serial_io_abort_open(sio);
 	}
 
 	/* Check if file is a terminal */
-	if (isatty(serial_handle) != 1) {
-		return -1;
+	if (isatty(sio->handle) != 1) {
+		return serial_io_abort_open(sio);
 	}
 
 	/* Save initial system settings */
-	if(tcgetattr(serial_handle, &tio_initial)) {
-		return -1;
+	if(tcgetattr(sio->handle, &sio->tio_initial)) {
+		return serial_io_abort_open(sio);
+	}
+#ifdef __linux__
+	sio->latency_timer = serial_io_find_latency_timer(path);
+#endif
+
+#ifndef __linux__
+	if (serial_io_speed(speed) == B0) {
+		errno = EINVAL;
+		return serial_io_abort_open(sio);
 	}
+#endif
+	sio->link_speed = speed;
 
 	/* Set signal handler for SIGINT to catch user initiated ^C signals. This
-	 * allows serial_io to reset the serial settings and close the serial port
-	 * before the program exits. This is done after the port is opened and
-	 * before new configuration is set. */
+	 * allows serial_io to reset the serial settings and close the serial
+	 * ports before the program exits. This is done after the port is opened
+	 * and before new configuration is set. */
+	sio->next = open_ports;
+	open_ports = sio;
 	signal(SIGINT, _signal_handler);
 
-	speed_t serial_speed;
-	switch (speed) {
-	case 1200:
-		serial_speed = B1200;
-		break;
-	case 2400:
-		serial_speed = B2400;
-		break;
-	case 4800:
-		serial_speed = B4800;
-		break;
-	case 9600:
-		serial_speed = B9600;
-		break;
-	case 19200:
-		serial_speed = B19200;
-		break;
-	case 38400:
-		serial_speed = B38400;
-		break;
-	case 57600:
-		serial_speed = B57600;
-		break;
-	case 115200:
-		serial_speed = B115200;
-		break;
-	default:
-		errno = EINVAL;
+	if (serial_io_apply(sio->handle, &tio, speed, TCSANOW) < 0) {
+		serial_io_close(sio);
+		return NULL;
+	}
+	return sio;
+}
+
+static void serial_io_get_stats(void *ctx, transport_stats_t *out)
+{
+	serial_io_t *sio = ctx;
+
+	*out = sio->stats;
+	out->link_time_us = monotonic_us() - sio->open_time_us;
+}
+
+static int serial_io_set_speed(void *ctx, int speed)
+{
+	serial_io_t *sio = ctx;
+	struct termios tio;
+
+	/* TCSADRAIN: the bytes written so far leave at the current speed */
+	if ((tcgetattr(sio->handle, &tio) < 0) ||
+	    (serial_io_apply(sio->handle, &tio, speed, TCSADRAIN) < 0)) {
+		return -1;
+	}
+	sio->link_speed = speed;
+
+	return 0;
+}
+
+/*
+ * Enable or disable RTS/CTS flow control in the driver.
+ *
+ * The bytes written so far are sent with the previous setting.
+ */
+static int serial_io_apply_rtscts(int handle, int enable)
+{
+#ifdef CRTSCTS
+	struct termios tio;
+
+	if (tcgetattr(handle, &tio) < 0) {
 		return -1;
 	}
-	cfsetospeed(&tio, serial_speed);
-	cfsetispeed(&tio, serial_speed);
+	if (enable) {
+		tio.c_cflag |= CRTSCTS;
+	} else {
+		tio.c_cflag &= ~CRTSCTS;
+	}
+
+	return tcsetattr(handle, TCSADRAIN, &tio);
+#else
+	(void)handle;
+	if (!enable) {
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static int serial_io_set_flow_control(void *ctx, int enable)
+{
+	serial_io_t *sio = ctx;
 
-	if (tcsetattr(serial_handle, TCSANOW, &tio) < 0) {
+	if (serial_io_apply_rtscts(sio->handle, enable) < 0) {
 		return -1;
 	}
-	return serial_handle;
+	sio->rtscts = enable;
+
+	return 0;
+}
+
+/*
+ * Enable or disable the low-latency mode of the port.
+ *
+ * Two settings are involved: the low-latency flag of the driver (which also
+ * sets the latency timer on older FTDI drivers) and, on USB-serial adapters
+ * exposing it in sysfs, the latency timer itself. Their initial values are
+ * saved the first time and restored by serial_io_close().
+ *
+ * Not all drivers support the flag: it fails only if neither setting can be
+ * changed, or if the latency timer exists but cannot be written (e.g., no
+ * permission), as it is then the one delaying the responses.
+ */
+static int serial_io_set_low_latency(void *ctx, int enable)
+{
+	serial_io_t *sio = ctx;
+#ifdef __linux__
+	int initial;
+	int ms;
+	int ret;
+
+	ret = serial_io_apply_low_latency(sio->handle, enable, &initial);
+	if (!ret && (sio->low_latency_initial < 0)) {
+		sio->low_latency_initial = initial;
+	}
+	if (!sio->latency_timer) {
+		return ret;
+	}
+	if (sio->latency_timer_initial < 0) {
+		sio->latency_timer_initial =
+		    serial_io_latency_timer(sio->latency_timer, -1);
+		if (sio->latency_timer_initial < 0) {
+			return -1;
+		}
+		snprintf(sio->latency_timer_restore,
+			 sizeof(sio->latency_timer_restore), "%d\n",
+			 sio->latency_timer_initial);
+	}
+	ms = enable ? SERIAL_IO_LATENCY_TIMER_MS : sio->latency_timer_initial;
+
+	return serial_io_latency_timer(sio->latency_timer, ms);
+#else
+	(void)sio;
+	if (!enable) {
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+#endif
 }
 
-int serial_detach(void)
+/*
+ * Use the RTS line to simulate a DFU detach command.
+ *
+ * The driver must not drive RTS during the pulse: flow control is suspended.
+ */
+static int serial_detach(void *ctx)
 {
+	serial_io_t *sio = ctx;
 	int status = 0;
 	int ret = 0;
-	ret = ioctl(serial_handle, TIOCMGET, &status);
+
+	if (sio->rtscts && (serial_io_apply_rtscts(sio->handle, 0) < 0)) {
+		return -1;
+	}
+	ret = ioctl(sio->handle, TIOCMGET, &status);
 
 	if (ret < 0) {
 		return ret;
 	}
 
 	status |= TIOCM_RTS;
-	ret = ioctl(serial_handle, TIOCMSET, &status);
+	ret = ioctl(sio->handle, TIOCMSET, &status);
 
 	if (ret < 0) {
 		return ret;
@@ -180,26 +663,79 @@ int serial_detach(void)
 	/* Keep RTS pulled low for 100 ms. */
 	usleep(100000);
 	status &= ~TIOCM_RTS;
-	ret = ioctl(serial_handle, TIOCMSET, &status);
+	ret = ioctl(sio->handle, TIOCMSET, &status);
 	if (ret < 0) {
 		return ret;
 	}
+	if (sio->rtscts) {
+		ret = serial_io_apply_rtscts(sio->handle, 1);
+	}
 
 	return ret;
 }
 
-int serial_io_close(void)
+/*
+ * Set the initial system settings of a port back.
+ *
+ * Only async-signal-safe calls are made, as this is also done by the signal
+ * handler: e.g., the latency timer value was formatted beforehand.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int serial_io_restore(serial_io_t *sio)
 {
-	if (serial_handle == -1) {
-		return -1;
+	int ret;
+#ifdef __linux__
+	size_t len;
+	int fd;
+#endif
+
+	ret = tcsetattr(sio->handle, TCSANOW, &sio->tio_initial);
+#ifdef __linux__
+	if ((sio->low_latency_initial >= 0) &&
+	    serial_io_apply_low_latency(sio->handle, sio->low_latency_initial,
+					NULL)) {
+		ret = -1;
 	}
+	if (sio->latency_timer_initial >= 0) {
+		len = strlen(sio->latency_timer_restore);
+		fd = open(sio->latency_timer, O_WRONLY);
+		if ((fd < 0) ||
+		    (write(fd, sio->latency_timer_restore, len) !=
+		     (ssize_t)len)) {
+			ret = -1;
+		}
+		if ((fd >= 0) && close(fd)) {
+			ret = -1;
+		}
+	}
+#endif
 
-	/* Set initial system settings. */
-	if(tcsetattr(serial_handle, TCSANOW, &tio_initial)) {
-		return -1;
+	return ret ? -1 : 0;
+}
+
+static int serial_io_close(void *ctx)
+{
+	serial_io_t *sio = ctx;
+	serial_io_t **p;
+	int ret;
+
+	/* Remove the port from the list of open ones */
+	for (p = &open_ports; *p; p = &(*p)->next) {
+		if (*p == sio) {
+			*p = sio->next;
+			break;
+		}
 	}
 
-	return close(serial_handle);
+	ret = serial_io_restore(sio);
+	if (close(sio->handle)) {
+		ret = -1;
+	}
+	free(sio->latency_timer);
+	free(sio);
+
+	return ret;
 }
 
 #if _BullseyeCoverage
@@ -208,13 +744,37 @@ int serial_io_close(void)
 
 static void _signal_handler(int sig)
 {
-	/* Clean up open serial port before exiting. */
-	serial_io_close();
+	serial_io_t *sio;
+
+	/*
+	 * Clean up open serial ports before exiting. Nothing is freed, and
+	 * _exit() is used instead of exit(): neither is safe in a handler.
+	 */
+	for (sio = open_ports; sio; sio = sio->next) {
+		serial_io_restore(sio);
+		close(sio->handle);
+	}
 
 	/* Exit codes for kill signals are (128 + signal_number). */
-	exit(128 + sig);
+	_exit(128 + sig);
 }
 
 #if _BullseyeCoverage
 #pragma BullseyeCoverage on
 #endif
+
+const transport_t serial_io_transport = {
+	.name = "Serial",
+	.open = serial_io_open,
+	.close = serial_io_close,
+	.read = serial_io_read,
+	.writev = serial_io_writev,
+	.set_deadline = serial_io_set_deadline,
+	.get_time_us = serial_io_get_time_us,
+	.tx_time_us = serial_io_tx_time_us,
+	.set_speed = serial_io_set_speed,
+	.set_flow_control = serial_io_set_flow_control,
+	.set_low_latency = serial_io_set_low_latency,
+	.detach = serial_detach,
+	.get_stats = serial_io_get_stats,
+};
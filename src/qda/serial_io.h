@@ -20,38 +20,20 @@
 #define _SERIAL_IO_H_
 
 #include <stdint.h>
-#include "xmodem.h"
+#include "transport.h"
 
 /**
- * Open serial port for XMODEM usage.
- *
- * @param[in] path Path to serial interface.
- * @param[in] speed XMODEM speed.
- * @param[out] handle Stores the resulting device handle.
- *
- * @retval Serial interface handle or error status
- * @retval >0 Serial interface handle.
- * @retval -1 Error (Check errno)
+ * A serial port (opaque).
  */
-int serial_io_open(const char *path, int speed);
-
-/**
- * Close serial port after XMODEM usage.
- *
- * @retval Error Status
- * @retval 0 Success
- * @retval -1 Error (Check errno)
- */
-int serial_io_close(void);
-
+typedef struct serial_io serial_io_t;
 
 /**
- * Uses RTS line to simulate a DFU detach command.
+ * Serial port transport, for XMODEM usage.
  *
- * @retval Error Status
- * @retval 0 Success
- * @retval -1 Error (Check errno)
+ * open() takes the path of the serial interface and the baud rate; several
+ * ports can be open at the same time. detach() uses the RTS line to simulate
+ * a DFU detach command.
  */
-int serial_detach(void);
+extern const transport_t serial_io_transport;
 
 #endif /* _SERIAL_IO_H_ */
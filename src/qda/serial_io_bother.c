@@ -0,0 +1,42 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+#include "serial_io_bother.h"
+
+int serial_io_set_custom_speed(int handle, int speed)
+{
+	struct termios2 tio2;
+
+	if (speed <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ioctl(handle, TCGETS2, &tio2) < 0) {
+		return -1;
+	}
+	tio2.c_cflag &= ~CBAUD;
+	tio2.c_cflag |= BOTHER;
+	tio2.c_ispeed = speed;
+	tio2.c_ospeed = speed;
+
+	return ioctl(handle, TCSETS2, &tio2);
+}
@@ -0,0 +1,36 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _SERIAL_IO_BOTHER_H_
+#define _SERIAL_IO_BOTHER_H_
+
+/**
+ * Set an arbitrary baud rate on a serial port (Linux only).
+ *
+ * The rate is set with the kernel termios2 interface (BOTHER flag). Its
+ * headers cannot be included together with the C library termios, so this is
+ * built on its own, only if configure finds them (HAVE_SERIAL_IO_BOTHER).
+ *
+ * @param[in] handle The port, already configured with the C library termios.
+ * @param[in] speed  The speed, in baud.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int serial_io_set_custom_speed(int handle, int speed);
+
+#endif /* _SERIAL_IO_BOTHER_H_ */
@@ -27,73 +27,194 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "xmodem.h"
+#include "serial_io.h"
 
 /* Support for up to COM 999 */
 #define MAX_COM_PATH_LEN 11
 #define COM_PATH_ESPACE_PREFIX "\\\\.\\"
 
-static HANDLE serial_handle;
-static DCB serial_initial_params;
+/*
+ * A serial port.
+ */
+struct serial_io {
+	HANDLE handle;
+	DCB initial_params;
+	transport_stats_t stats;
+	/* Time the port was opened, in microseconds */
+	uint64_t open_time_us;
+	/* Timeout currently set in the driver, in milliseconds (-1 if unknown) */
+	int cur_timeout_ms;
+	/* Baud rate of the serial port */
+	int link_speed;
+	/* Whether RTS/CTS flow control is enabled */
+	int rtscts;
+	/* Frame-sized buffer used to coalesce gather writes */
+	uint8_t tx_buf[3 + XMODEM_1K_BLOCK_SIZE + 2];
+};
 
-void xmodem_putc(uint8_t *ch)
+/*
+ * Get the current time of the performance counter, in microseconds.
+ */
+static uint64_t perf_counter_us(void)
 {
-	WriteFile(serial_handle, ch, 1, NULL, NULL);
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+	       (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 /
+		   freq.QuadPart;
+}
+
+static uint64_t serial_io_get_time_us(void *ctx)
+{
+	(void)ctx;
+
+	return perf_counter_us();
 }
 
 /*
- * Get a character from the XMODEM I/O layer.
+ * Get the time needed to transmit some bytes at the current baud rate (8n1,
+ * i.e., 10 bits per byte), in microseconds.
+ */
+static uint32_t serial_io_tx_time_us(void *ctx, size_t len)
+{
+	serial_io_t *sio = ctx;
+
+	return sio->link_speed
+		   ? (uint64_t)len * 10 * 1000000 / sio->link_speed
+		   : 0;
+}
+
+/*
+ * Write a buffer to the serial port.
  *
- * This function must be blocking, but is also expected to timeout after a
- * certain amount of time. Moreover, in case of error, the function must not
- * set the output parameter (i.e., the pointed variable must remain unchanged).
+ * The buffer is handed to the driver with a single WriteFile() call, unless
+ * the driver accepts only part of it.
  *
- * @param[out] ch A pointer to the variable where to store the read character.
- * 		  In case of error, the current value of the pointed variable
- * 		  is not modified.
+ * @param[in] sio The serial port.
+ * @param[in] buf The data to write.
+ * @param[in] len The length of the data.
  *
  * @return 0 on success, negative error code otherwise.
+ * @retval -EIO in case of I/O error.
+ */
+static int serial_io_write(serial_io_t *sio, const uint8_t *buf, size_t len)
+{
+	DWORD n_bytes_written;
+
+	while (len) {
+		n_bytes_written = 0;
+		sio->stats.syscalls++;
+		if ((WriteFile(sio->handle, buf, len, &n_bytes_written,
+			       NULL) == 0) ||
+		    (n_bytes_written == 0)) {
+			return -EIO;
+		}
+		sio->stats.tx_bytes += n_bytes_written;
+		buf += n_bytes_written;
+		len -= n_bytes_written;
+	}
+
+	return 0;
+}
+
+/*
+ * Windows has no gather write for COM ports: coalesce the segments into a
+ * frame-sized buffer and issue a single WriteFile().
+ */
+static int serial_io_writev(void *ctx, const transport_iovec_t *iov,
+			    int iovcnt)
+{
+	serial_io_t *sio = ctx;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].len > sizeof(sio->tx_buf) - len) {
+			return -EINVAL;
+		}
+		memcpy(&sio->tx_buf[len], iov[i].base, iov[i].len);
+		len += iov[i].len;
+	}
+
+	return serial_io_write(sio, sio->tx_buf, len);
+}
+
+/*
+ * Read the bytes available on the serial port.
+ *
+ * If the driver has no data, wait for some until the timeout set with
+ * serial_io_set_deadline() expires.
+ *
+ * @return Number of bytes read or negative error code.
  * @retval -ETIMEDOUT in case of timeout.
  * @retval -EIO   in case of I/O error.
  */
-int xmodem_getc(uint8_t *ch)
+static int serial_io_read(void *ctx, uint8_t *buf, size_t len)
 {
+	serial_io_t *sio = ctx;
 	DWORD n_bytes_read = 0;
 
-	ReadFile(serial_handle, ch, 1, &n_bytes_read, NULL);
-	switch (n_bytes_read) {
-		case 1:
-			/* We read one character as expected: success */
-			return 0;
-		case 0:
-			/* We read 0 characters: we timed out */
-			return -ETIMEDOUT;
-		default:
-			/* Error or unexpected value: generic I/O error */
-			return -EIO;
-
+	/*
+	 * The read timeouts set by serial_io_set_deadline() make ReadFile()
+	 * return as soon as at least one byte is available, with all the bytes
+	 * the driver has at that moment.
+	 */
+	sio->stats.syscalls++;
+	if (ReadFile(sio->handle, buf, len, &n_bytes_read, NULL) == 0) {
+		/* Generic I/O error */
+		return -EIO;
+	}
+	if (n_bytes_read == 0) {
+		/* We read 0 characters: we timed out */
+		return -ETIMEDOUT;
 	}
+	sio->stats.rx_bytes += n_bytes_read;
+
+	return n_bytes_read;
 }
 
-int xmodem_set_timeout(int ms)
+static int serial_io_set_deadline(void *ctx, int ms)
 {
+	serial_io_t *sio = ctx;
 	COMMTIMEOUTS timeouts = {0};
 
-	// Set COM port timeout settings
-	timeouts.ReadIntervalTimeout = ms;
+	/* Avoid reconfiguring the driver if the timeout is unchanged */
+	if (ms == sio->cur_timeout_ms) {
+		return 0;
+	}
+
+	/*
+	 * Set COM port timeout settings: with these values, ReadFile() returns
+	 * immediately with the bytes already received, or waits up to 'ms'
+	 * milliseconds for the first byte to arrive.
+	 */
+	timeouts.ReadIntervalTimeout = MAXDWORD;
 	timeouts.ReadTotalTimeoutConstant = ms;
-	timeouts.ReadTotalTimeoutMultiplier = 0;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	/*
+	 * A write is given the time to put its bytes on the line (the byte
+	 * time, rounded up to a millisecond) on top of the deadline: the
+	 * deadline alone, sized for an ACK, is shorter than a 1K frame.
+	 */
 	timeouts.WriteTotalTimeoutConstant = ms;
-	timeouts.WriteTotalTimeoutMultiplier = 0;
-	if(SetCommTimeouts(serial_handle, &timeouts) == 0) {
-		CloseHandle(serial_handle);
+	timeouts.WriteTotalTimeoutMultiplier =
+	    (10 * 1000 + sio->link_speed - 1) / sio->link_speed;
+	sio->stats.syscalls++;
+	if(SetCommTimeouts(sio->handle, &timeouts) == 0) {
 		return -1;
 	}
+	sio->cur_timeout_ms = ms;
 
 	return 0;
 }
 
-int serial_io_open(char *path, int speed)
+static void *serial_io_open(const char *path, int speed)
 {
+	serial_io_t *sio;
 	DCB serial_params = {0};
 	char escaped_path[MAX_COM_PATH_LEN];
 	int escaping_path_ret_v;
@@ -109,97 +230,199 @@ int serial_io_open(char *path, int speed)
  	/* Fail in case of error or input string too long */
 	if ((escaping_path_ret_v < 0) ||
 	   (escaping_path_ret_v >= MAX_COM_PATH_LEN)) {
-		return -1;
+		return NULL;
+	}
+
+	sio = calloc(1, sizeof(*sio));
+	if (!sio) {
+		return NULL;
 	}
+	sio->cur_timeout_ms = -1;
+	sio->open_time_us = perf_counter_us();
 
 	/* Open the serial port */
-	serial_handle = CreateFile(
+	sio->handle = CreateFile(
 		escaped_path, GENERIC_READ|GENERIC_WRITE, 0, NULL,
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
-	if (serial_handle == INVALID_HANDLE_VALUE) {
-		return -1;
+	if (sio->handle == INVALID_HANDLE_VALUE) {
+		free(sio);
+		return NULL;
 	}
 
 	/* Save original serial params */
-	if(GetCommState(serial_handle, &serial_initial_params) == 0) {
-		CloseHandle(serial_handle);
-		return -1;
+	if(GetCommState(sio->handle, &sio->initial_params) == 0) {
+		CloseHandle(sio->handle);
+		free(sio);
+		return NULL;
 	}
 
 	/* Set the comm parameters */
 	serial_params.ByteSize = 8;
 	serial_params.StopBits = ONESTOPBIT;
 	serial_params.Parity = NOPARITY;
-	switch (speed) {
-	case 1200:
-		serial_params.BaudRate = CBR_1200;
-		break;
-	case 2400:
-		serial_params.BaudRate = CBR_2400;
-		break;
-	case 4800:
-		serial_params.BaudRate = CBR_4800;
-		break;
-	case 9600:
-		serial_params.BaudRate = CBR_9600;
-		break;
-	case 19200:
-		serial_params.BaudRate = CBR_19200;
-		break;
-	case 38400:
-		serial_params.BaudRate = CBR_38400;
-		break;
-	case 57600:
-		serial_params.BaudRate = CBR_57600;
-		break;
-	case 115200:
-		serial_params.BaudRate = CBR_115200;
-		break;
-	default:
+	/*
+	 * The baud rate is a plain number (CBR_* are the standard ones): any
+	 * rate the driver supports is accepted by SetCommState()
+	 */
+	if (speed <= 0) {
+		CloseHandle(sio->handle);
+		free(sio);
+		errno = EINVAL;
+		return NULL;
+	}
+	serial_params.BaudRate = speed;
+	if(SetCommState(sio->handle, &serial_params) == 0) {
+		CloseHandle(sio->handle);
+		free(sio);
+		return NULL;
+	}
+	sio->link_speed = speed;
+
+	return sio;
+}
+
+static void serial_io_get_stats(void *ctx, transport_stats_t *out)
+{
+	serial_io_t *sio = ctx;
+
+	*out = sio->stats;
+	out->link_time_us = perf_counter_us() - sio->open_time_us;
+}
+
+static int serial_io_set_speed(void *ctx, int speed)
+{
+	serial_io_t *sio = ctx;
+	DCB params;
+
+	/* Let the bytes written so far leave at the current speed */
+	FlushFileBuffers(sio->handle);
+	if ((speed <= 0) || (GetCommState(sio->handle, &params) == 0)) {
 		errno = EINVAL;
 		return -1;
 	}
-	if(SetCommState(serial_handle, &serial_params) == 0) {
-		CloseHandle(serial_handle);
+	params.BaudRate = speed;
+	if (SetCommState(sio->handle, &params) == 0) {
+		errno = EIO;
 		return -1;
 	}
+	sio->link_speed = speed;
+	/* The write timeout depends on the speed: set it again */
+	sio->cur_timeout_ms = -1;
 
 	return 0;
 }
 
-int serial_detach(void)
+/*
+ * Enable or disable RTS/CTS flow control in the driver.
+ */
+static int serial_io_apply_rtscts(HANDLE handle, int enable)
 {
+	DCB params;
 
-	if (EscapeCommFunction(serial_handle, SETRTS) == 0) {
+	if (GetCommState(handle, &params) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	params.fOutxCtsFlow = !!enable;
+	params.fRtsControl =
+	    enable ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_DISABLE;
+	if (SetCommState(handle, &params) == 0) {
+		errno = EIO;
 		return -1;
 	}
 
-	/* Keep RTS pulled low for 100 ms. */
-	usleep(100000);
+	return 0;
+}
 
+static int serial_io_set_flow_control(void *ctx, int enable)
+{
+	serial_io_t *sio = ctx;
 
-	if (EscapeCommFunction(serial_handle, CLRRTS) == 0) {
+	if (serial_io_apply_rtscts(sio->handle, enable) < 0) {
 		return -1;
 	}
+	sio->rtscts = enable;
 
 	return 0;
 }
 
-int serial_io_close(void)
+/*
+ * Enable or disable the low-latency mode of the port.
+ *
+ * The latency timer of USB-serial adapters is a setting of their driver (in
+ * the device manager), which the communications API cannot change.
+ */
+static int serial_io_set_low_latency(void *ctx, int enable)
+{
+	(void)ctx;
+	if (!enable) {
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * Use the RTS line to simulate a DFU detach command.
+ *
+ * RTS cannot be set by hand in handshake mode: flow control is suspended.
+ */
+static int serial_detach(void *ctx)
 {
-	if (serial_handle == INVALID_HANDLE_VALUE) {
+	serial_io_t *sio = ctx;
+
+	if (sio->rtscts && (serial_io_apply_rtscts(sio->handle, 0) < 0)) {
 		return -1;
 	}
-
-	/* Set initial system settings. */
-	if (SetCommState(serial_handle, &serial_initial_params) == 0) {
+	if (EscapeCommFunction(sio->handle, SETRTS) == 0) {
 		return -1;
 	}
 
-	if (CloseHandle(serial_handle) == 0) {
+	/* Keep RTS pulled low for 100 ms. */
+	usleep(100000);
+
+
+	if (EscapeCommFunction(sio->handle, CLRRTS) == 0) {
 		return -1;
 	}
+	if (sio->rtscts) {
+		return serial_io_apply_rtscts(sio->handle, 1);
+	}
 
 	return 0;
 }
+
+static int serial_io_close(void *ctx)
+{
+	serial_io_t *sio = ctx;
+	int ret = 0;
+
+	/* Set initial system settings. */
+	if (SetCommState(sio->handle, &sio->initial_params) == 0) {
+		ret = -1;
+	}
+
+	if (CloseHandle(sio->handle) == 0) {
+		ret = -1;
+	}
+	free(sio);
+
+	return ret;
+}
+
+const transport_t serial_io_transport = {
+	.name = "Serial",
+	.open = serial_io_open,
+	.close = serial_io_close,
+	.read = serial_io_read,
+	.writev = serial_io_writev,
+	.set_deadline = serial_io_set_deadline,
+	.get_time_us = serial_io_get_time_us,
+	.tx_time_us = serial_io_tx_time_us,
+	.set_speed = serial_io_set_speed,
+	.set_flow_control = serial_io_set_flow_control,
+	.set_low_latency = serial_io_set_low_latency,
+	.detach = serial_detach,
+	.get_stats = serial_io_get_stats,
+};
@@ -0,0 +1,250 @@
+/*
+ * Quark Microcontroller DFU Utility
+ * Copyright (C) 2016, Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License version 2 only, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A segment of a scatter-gather list.
+ */
+typedef struct {
+	uint8_t *base; /**< Start of the segment. */
+	size_t len;    /**< Length of the segment. */
+} transport_iovec_t;
+
+/**
+ * Transport statistics.
+ */
+typedef struct {
+	/** Number of system calls issued to the driver. */
+	unsigned long syscalls;
+	/** Number of bytes written to the link. */
+	unsigned long tx_bytes;
+	/** Number of bytes read from the link. */
+	unsigned long rx_bytes;
+	/** Time elapsed on the link since it was opened, in microseconds. */
+	uint64_t link_time_us;
+} transport_stats_t;
+
+/**
+ * A transport, i.e., the byte link XMODEM runs on.
+ *
+ * Every function but open() takes the context returned by open().
+ */
+typedef struct transport {
+	/** Name of the transport, for messages. */
+	const char *name;
+
+	/**
+	 * Open the link.
+	 *
+	 * @param[in] path  Path (or description) of the link.
+	 * @param[in] speed Link speed, in baud.
+	 *
+	 * @return The context of the link or NULL on error (check errno).
+	 */
+	void *(*open)(const char *path, int speed);
+
+	/**
+	 * Close the link and release its context.
+	 *
+	 * @return 0 on success, -1 on error (check errno).
+	 */
+	int (*close)(void *ctx);
+
+	/**
+	 * Read the bytes available on the link.
+	 *
+	 * If no byte is available, wait for some until the deadline set with
+	 * set_deadline() expires.
+	 *
+	 * @return Number of bytes read (at least one) or negative error code.
+	 * @retval -ETIMEDOUT in case of timeout.
+	 * @retval -EIO in case of I/O error.
+	 */
+	int (*read)(void *ctx, uint8_t *buf, size_t len);
+
+	/**
+	 * Write a scatter-gather list (typically a whole XMODEM frame).
+	 *
+	 * @return 0 on success, negative error code otherwise.
+	 */
+	int (*writev)(void *ctx, const transport_iovec_t *iov, int iovcnt);
+
+	/**
+	 * Set how long read() waits for data, in milliseconds.
+	 *
+	 * The deadline is computed when read() starts waiting.
+	 *
+	 * @return 0 on success, negative error code otherwise.
+	 */
+	int (*set_deadline)(void *ctx, int ms);
+
+	/**
+	 * Get the current time of the link clock, in microseconds.
+	 */
+	uint64_t (*get_time_us)(void *ctx);
+
+	/**
+	 * Get the time needed to transmit some bytes on the link, in
+	 * microseconds.
+	 */
+	uint32_t (*tx_time_us)(void *ctx, size_t len);
+
+	/**
+	 * Change the link speed.
+	 *
+	 * The bytes already written are sent at the previous speed first.
+	 *
+	 * @param[in] speed The new speed, in baud.
+	 *
+	 * @return 0 on success, -1 on error (check errno).
+	 */
+	int (*set_speed)(void *ctx, int speed);
+
+	/**
+	 * Enable or disable hardware (RTS/CTS) flow control.
+	 *
+	 * With flow control, the device can hold the host back (CTS) instead
+	 * of losing bytes when its UART FIFO is full. detach() suspends it
+	 * while it drives RTS.
+	 *
+	 * @param[in] enable Non-zero to enable flow control, 0 to disable it.
+	 *
+	 * @return 0 on success, -1 on error (check errno).
+	 */
+	int (*set_flow_control)(void *ctx, int enable);
+
+	/**
+	 * Enable or disable the low-latency mode of the link.
+	 *
+	 * USB-serial bridges hold received bytes back until their buffer
+	 * fills up or their latency timer expires (16 ms by default on FTDI
+	 * parts), which delays every response of the device. In low-latency
+	 * mode, they are passed on as soon as possible. The initial settings
+	 * are restored by close().
+	 *
+	 * @param[in] enable Non-zero to enable low latency, 0 to disable it.
+	 *
+	 * @return 0 on success, -1 on error (check errno).
+	 */
+	int (*set_low_latency)(void *ctx, int enable);
+
+	/**
+	 * Have the device detach, i.e., enter DFU mode.
+	 *
+	 * @return 0 on success, -1 on error (check errno).
+	 */
+	int (*detach)(void *ctx);
+
+	/**
+	 * Get the statistics collected since the link was opened.
+	 */
+	void (*get_stats)(void *ctx, transport_stats_t *stats);
+} transport_t;
+
+/**
+ * Loopback transport.
+ *
+ * It connects the host stack to an in-process model of a QDA device (see
+ * qda_device.h), with no TTY involved. The link clock is virtual: it only
+ * advances by the wire time of the bytes exchanged at the link speed and by
+ * the read timeouts that expire, so runs are deterministic and the link time
+ * can be compared with the real (host stack) time.
+ *
+ * The path is "loopback", optionally followed by ':' and a comma-separated
+ * list of device options (see qda_device_create()) and link options:
+ * - "latency=<us>": round-trip latency of the link (e.g., of a USB-serial
+ *   adapter), added to every response of the device; in low-latency mode,
+ *   it is at most LOOPBACK_LOW_LATENCY_US;
+ * - "maxlink=<baud>": highest speed the link carries; above it (as when the
+ *   host and the device speeds differ) every byte is garbled;
+ * - "noise=<rate>@<baud>": per-byte error rate of the link above the given
+ *   speed (e.g., a marginal cable).
+ */
+extern const transport_t loopback_transport;
+
+/** Prefix of the paths selecting the loopback transport. */
+#define LOOPBACK_PATH "loopback"
+
+/** Latency of the loopback link in low-latency mode, in microseconds. */
+#define LOOPBACK_LOW_LATENCY_US (1000)
+
+/**
+ * Statistics of the faults injected by the fault transport.
+ */
+typedef struct {
+	/** Number of bits flipped. */
+	unsigned long flipped;
+	/** Number of bytes dropped (truncations included). */
+	unsigned long dropped;
+	/** Number of garbage bytes inserted. */
+	unsigned long junk;
+	/** Number of chunks (frames) truncated. */
+	unsigned long truncated;
+	/** Number of reads delayed. */
+	unsigned long delayed;
+} fault_stats_t;
+
+/**
+ * Fault transport.
+ *
+ * It wraps another transport and damages the bytes going through it, in both
+ * directions, to measure how the protocol recovers from line errors. Faults
+ * are drawn from a seeded pseudo-random generator, so runs are reproducible
+ * (on the loopback transport, exactly).
+ *
+ * It has no open(): use fault_transport_wrap() instead. Closing it closes the
+ * wrapped transport too.
+ */
+extern const transport_t fault_transport;
+
+/**
+ * Wrap a transport into a fault transport.
+ *
+ * The specification is a comma-separated list of:
+ * - "flip=<rate>": probability of a bit flip, per byte;
+ * - "drop=<rate>": probability of a byte being lost, per byte;
+ * - "junk=<rate>": probability of garbage being inserted, per chunk (i.e.,
+ *   per write or read);
+ * - "trunc=<rate>": probability of the tail of a chunk being lost;
+ * - "delay=<rate>": probability of a read being delayed (e.g., an ACK);
+ * - "delay_ms=<ms>": the delay (default 100 ms);
+ * - "seed=<n>": the seed of the pseudo-random generator (default 1).
+ *
+ * @param[in] tr     The transport to wrap.
+ * @param[in] tr_ctx The context of the transport to wrap.
+ * @param[in] spec   The fault specification.
+ *
+ * @return The context of the fault transport or NULL on error (check errno).
+ */
+void *fault_transport_wrap(const transport_t *tr, void *tr_ctx,
+			   const char *spec);
+
+/**
+ * Get the statistics of the faults injected so far.
+ *
+ * @param[in]  ctx   The context of the fault transport.
+ * @param[out] stats The statistics.
+ */
+void fault_transport_get_stats(void *ctx, fault_stats_t *stats);
+
+#endif /* _TRANSPORT_H_ */
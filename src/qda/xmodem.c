@@ -30,22 +30,26 @@
 #define TIMEOUT_STD 3000
 #define TIMEOUT_ERR 300
 
+/* Bounds of the adaptive retransmission timeout (RTO), in milliseconds */
+#define RTO_MIN 20
+#define RTO_MAX TIMEOUT_STD
+
 /* Custom value, not transfered via XMODEM, but used as return codes */
 #define ERR (0xFF)
 #define DUP (0xFE)
 
 /* XMODEM control bytes */
 #define SOH (0x01)
+#define STX (0x02)
+#define SOH_SHORT (XMODEM_SOH_SHORT)
 #define EOT (0x04)
 #define ACK (0x06)
 #define NAK (0x15)
 #define CAN (0x18)
 
-/* XMODEM block size */
+/* XMODEM block sizes: SOH frames carry 128 bytes, STX frames 1024 bytes */
 #define PACKET_PAYLOAD_SIZE (XMODEM_BLOCK_SIZE)
-
-/* CRC-16 CCITT */
-#define POLY 0x1021
+#define PACKET_PAYLOAD_SIZE_1K (XMODEM_1K_BLOCK_SIZE)
 
 /* Activate debug messages by defining DEBUG_MSG to 1 */
 #define DEBUG_MSG (0)
@@ -56,134 +60,501 @@
 #define printd(...)
 #endif
 
-extern int xmodem_getc(uint8_t *ch);
-extern void xmodem_putc(uint8_t *ch);
-extern int xmodem_set_timeout(int ms);
 
 /**
- * The XMODEM packet buffer.
+ * A position in a scatter-gather list.
+ */
+typedef struct {
+	const xmodem_iovec_t *iov;
+	int iovcnt;
+	/* Current segment */
+	int idx;
+	/* Offset in the current segment */
+	size_t off;
+} iov_cursor_t;
+
+/*
+ * Get a character from the transport.
+ *
+ * This function is blocking, but times out after the time set with
+ * xmodem_set_timeout(). In case of error, the output parameter is not set
+ * (i.e., the pointed variable remains unchanged).
+ *
+ * Bytes are served from the receive buffer; the transport is only queried
+ * (and the timeout only applies) when the buffer is empty.
+ *
+ * @param[in]  xm The XMODEM session.
+ * @param[out] ch A pointer to the variable where to store the read character.
+ *
+ * @return 0 on success, negative error code otherwise.
+ * @retval -ETIMEDOUT in case of timeout.
+ * @retval -EIO       in case of I/O error.
+ */
+static int xmodem_getc(xmodem_t *xm, uint8_t *ch)
+{
+	int retv;
+
+	if (xm->rx_head == xm->rx_tail) {
+		retv = xm->tr->read(xm->tr_ctx, xm->rx_buf, sizeof(xm->rx_buf));
+		if (retv < 0) {
+			xm->stats.timeouts += (retv == -ETIMEDOUT);
+			return retv;
+		}
+		xm->rx_head = 0;
+		xm->rx_tail = retv;
+	}
+	*ch = xm->rx_buf[xm->rx_head++];
+
+	return 0;
+}
+
+/*
+ * Put a character on the transport.
  *
- * This buffer is used for both incoming and outgoing packets.
+ * @param[in] xm The XMODEM session.
+ * @param[in] ch A pointer to the character to send.
  */
-static struct __attribute__((__packed__)) xmodem_packet {
-	uint8_t soh;
-	uint8_t seq_no;
-	uint8_t seq_no_inv;
-	uint8_t data[PACKET_PAYLOAD_SIZE];
-	uint8_t crc_u8[2];
-} pkt_buf;
+static void xmodem_putc(xmodem_t *xm, uint8_t *ch)
+{
+	xmodem_iovec_t iov;
+
+	iov.base = ch;
+	iov.len = 1;
+	xm->tr->writev(xm->tr_ctx, &iov, 1);
+}
+
+/*
+ * Set the time xmodem_getc() waits for data, in milliseconds.
+ *
+ * @param[in] xm The XMODEM session.
+ * @param[in] ms The timeout.
+ */
+static void xmodem_set_timeout(xmodem_t *xm, int ms)
+{
+	if (xm->max_timeout && (ms > xm->max_timeout)) {
+		ms = xm->max_timeout;
+	}
+	xm->tr->set_deadline(xm->tr_ctx, ms);
+}
+
+/*
+ * Get the current time of the transport clock, in microseconds.
+ *
+ * @param[in] xm The XMODEM session.
+ */
+static uint64_t xmodem_get_time_us(xmodem_t *xm)
+{
+	return xm->tr->get_time_us(xm->tr_ctx);
+}
+
+/*
+ * CRC-16 CCITT lookup table (polynomial 0x1021, MSB first).
+ *
+ * Entry 'i' is the CRC remainder of the byte 'i' followed by 16 'zero' bits,
+ * which allows the CRC to be updated one byte at a time instead of one bit at
+ * a time.
+ */
+static const uint16_t crc_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+uint16_t crc_xmodem_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len--) {
+		crc = (crc << 8) ^ crc_table[((crc >> 8) ^ *data++) & 0xFF];
+	}
+
+	return crc;
+}
 
 /**
- *  Compute CRC.
+ * Update the round-trip time estimation with a new sample.
  *
- *  This function computes CRC 16bits CCITT of the payload, which means:
- *  - with CRC initialized to 0xffff
- *  - with 16 'zero' bits appended to the end of the message
- *  - 0x1021 for the polynomial
+ * Samples must not be taken for retransmitted frames, as it is not possible
+ * to know which transmission the response refers to (Karn's algorithm).
  *
- *  @retval computed CRC value
+ * @param[in] xm      The XMODEM session.
+ * @param[in] tx_done The time the frame was expected to have left the wire.
  */
-static uint16_t crc_xmodem(void)
-{
-	uint8_t i, b;
-	uint8_t data;
-	uint32_t crc = 0;
-
-	for (i = 0; i < PACKET_PAYLOAD_SIZE; i++) {
-		data = pkt_buf.data[i];
-		for (b = 0; b < 8; b++) {
-			crc <<= 1;
-			/* add MSB bit of data to message */
-			if (data & 0x80) {
-				crc |= 1;
-			}
-			if (crc & 0x10000)
-				crc ^= POLY;
-			data <<= 1;
+static void rtt_sample(xmodem_t *xm, uint64_t tx_done)
+{
+	xmodem_rtt_t *rtt = &xm->rtt;
+	uint64_t now = xmodem_get_time_us(xm);
+	uint32_t r = (now > tx_done) ? (uint32_t)(now - tx_done) : 0;
+	uint32_t delta;
+	uint32_t rto;
+
+	if (rtt->srtt == 0) {
+		rtt->srtt = r ? r : 1;
+		rtt->rttvar = r / 2;
+	} else {
+		delta = (rtt->srtt > r) ? (rtt->srtt - r) : (r - rtt->srtt);
+		rtt->rttvar = (3 * rtt->rttvar + delta) / 4;
+		rtt->srtt = (7 * rtt->srtt + r) / 8;
+	}
+	rto = (rtt->srtt + 4 * rtt->rttvar) / 1000;
+	rtt->rto = (rto < RTO_MIN) ? RTO_MIN : (rto > RTO_MAX) ? RTO_MAX : rto;
+	printd("rtt_sample(): rtt: %u us, srtt: %u us, rto: %d ms\n", r,
+	       rtt->srtt, rtt->rto);
+}
+
+/**
+ * Back off the retransmission timeout after a response has been lost.
+ *
+ * @param[in] xm The XMODEM session.
+ */
+static void rtt_backoff(xmodem_t *xm)
+{
+	xm->rtt.rto = (2 * xm->rtt.rto > RTO_MAX) ? RTO_MAX : 2 * xm->rtt.rto;
+}
+
+/**
+ * Set the I/O timeout to wait for the response to the last bytes written.
+ *
+ * The timeout is the RTO plus the time the bytes still need to leave the wire.
+ *
+ * @param[in] xm The XMODEM session.
+ */
+static void rtt_set_timeout(xmodem_t *xm)
+{
+	uint64_t now = xmodem_get_time_us(xm);
+	uint64_t wire = (xm->rtt.tx_done > now) ? xm->rtt.tx_done - now : 0;
+
+	xmodem_set_timeout(xm, xm->rtt.rto + (int)(wire / 1000));
+}
+
+/**
+ * Keep track of when the bytes written will have left the wire.
+ *
+ * @param[in] xm  The XMODEM session.
+ * @param[in] len The number of bytes just written.
+ *
+ * @return The time at which the last byte is expected to leave the wire.
+ */
+static uint64_t rtt_note_tx(xmodem_t *xm, size_t len)
+{
+	uint64_t now = xmodem_get_time_us(xm);
+
+	if (xm->rtt.tx_done < now) {
+		xm->rtt.tx_done = now;
+	}
+	xm->rtt.tx_done += xm->tr->tx_time_us(xm->tr_ctx, len);
+
+	return xm->rtt.tx_done;
+}
+
+/**
+ * Get the timeout used to detect that the sender stopped sending.
+ *
+ * @param[in] xm The XMODEM session.
+ *
+ * @return The timeout in milliseconds: the RTO, within [RTO_MIN, TIMEOUT_ERR].
+ */
+static int rtt_drain_timeout(const xmodem_t *xm)
+{
+	return (xm->rtt.rto > TIMEOUT_ERR) ? TIMEOUT_ERR : xm->rtt.rto;
+}
+
+/**
+ * Move a scatter-gather list cursor forward.
+ *
+ * @param[in,out] cur The cursor.
+ * @param[in]     n   The number of bytes to skip.
+ */
+static void iov_cursor_advance(iov_cursor_t *cur, size_t n)
+{
+	size_t step;
+
+	while (cur->idx < cur->iovcnt) {
+		step = cur->iov[cur->idx].len - cur->off;
+		if (n < step) {
+			cur->off += n;
+			return;
 		}
-	};
+		/* Move to the next segment (skipping empty segments too) */
+		n -= step;
+		cur->idx++;
+		cur->off = 0;
+	}
+}
+
+/**
+ * Initialize a scatter-gather list cursor.
+ *
+ * @param[out] cur    The cursor.
+ * @param[in]  iov    The scatter-gather list.
+ * @param[in]  iovcnt The number of segments in the list.
+ * @param[in]  pos    The initial position of the cursor.
+ */
+static void iov_cursor_init(iov_cursor_t *cur, const xmodem_iovec_t *iov,
+			    int iovcnt, size_t pos)
+{
+	cur->iov = iov;
+	cur->iovcnt = iovcnt;
+	cur->idx = 0;
+	cur->off = 0;
+	iov_cursor_advance(cur, pos);
+}
+
+/**
+ * Get the number of bytes between a cursor and the end of its list.
+ *
+ * @param[in] cur The cursor.
+ *
+ * @return The number of bytes left.
+ */
+static size_t iov_cursor_left(const iov_cursor_t *cur)
+{
+	size_t left = 0;
+	int i;
 
-	/* append 0 */
-	for (i = 0; i < 16; i++) {
-		if (crc & 0x8000)
-			crc = (crc << 1) ^ POLY;
-		else
-			crc <<= 1;
+	for (i = cur->idx; i < cur->iovcnt; i++) {
+		left += cur->iov[i].len;
 	}
 
-	return (uint16_t)(crc);
+	return left - cur->off;
+}
+
+/**
+ * Select the payload size of the next frame to transmit.
+ *
+ * 1K frames are used while there is at least a full 1K block to send; the
+ * tail goes in 128-byte frames to limit padding, or in a short frame (with no
+ * padding at all) if they are enabled.
+ *
+ * @param[in] xm  The XMODEM session.
+ * @param[in] len The number of bytes left to send.
+ *
+ * @return The payload size of the frame (128 or 1024 bytes, or less than 128
+ *	   bytes for a short frame).
+ */
+static size_t xmodem_frame_size(const xmodem_t *xm, size_t len)
+{
+	if (xm->use_short && len < PACKET_PAYLOAD_SIZE) {
+		return len;
+	}
+
+	return (xm->use_1k && len >= PACKET_PAYLOAD_SIZE_1K)
+		   ? PACKET_PAYLOAD_SIZE_1K
+		   : PACKET_PAYLOAD_SIZE;
 }
 
 /**
  * Send a single XMODEM packet.
  *
- * @param[in] data     The payload of the packet.
- * @param[in] data_len The length of the payload. Must be at most 128 bytes.
- *		       If less, (random) padding is automatically added.
+ * The packet is emitted with a single vectored write: header and CRC come
+ * from the packet buffer, while the payload is taken directly from the user's
+ * buffers.
+ *
+ * @param[in] xm       The XMODEM session.
+ * @param[in] data     The position of the payload in the user's buffers.
+ * @param[in] data_len The length of the payload. Must be at most 'pl_size'
+ *		       bytes. If less, (random) padding is automatically added.
+ * @param[in] pl_size  The payload size of the frame: PACKET_PAYLOAD_SIZE for
+ *		       an SOH frame, PACKET_PAYLOAD_SIZE_1K for an STX frame,
+ *		       anything less than PACKET_PAYLOAD_SIZE for a short frame.
  * @param[in] pkt_no   The desired packet sequence number.
  *
  * @return Resulting status code.
- * @retval 0 Success (only possible retval for now).
+ * @retval 0  Success.
+ * @retval <0 I/O error.
  */
-static int xmodem_send_pkt(const uint8_t *data, size_t data_len, uint8_t pkt_no)
+static int xmodem_send_pkt(xmodem_t *xm, const iov_cursor_t *data,
+			   size_t data_len, size_t pl_size, uint8_t pkt_no)
 {
-	size_t i;
-	uint8_t *buf;
+	xmodem_packet_t *pkt_buf = &xm->pkt_buf;
+	xmodem_iovec_t frame[XMODEM_MAX_IOV + 3];
+	iov_cursor_t cur = *data;
+	size_t frame_len;
+	size_t chunk;
 	uint16_t crc;
+	int n;
 
 	printd("xmodem_send_pkt(): pkt_no: %d\n", pkt_no);
-	pkt_buf.soh = SOH;
-	memcpy(pkt_buf.data, data, data_len);
-	crc = crc_xmodem();
-	pkt_buf.crc_u8[0] = (crc >> 8) & 0xFF;
-	pkt_buf.crc_u8[1] = crc & 0xFF;
-	pkt_buf.seq_no = pkt_no;
-	pkt_buf.seq_no_inv = ~pkt_no;
-	buf = (uint8_t *)&pkt_buf;
-	/* Send the packet */
-	for (i = 0; i < sizeof(pkt_buf); i++) {
-		xmodem_putc(&buf[i]);
+	pkt_buf->seq_no = pkt_no;
+	pkt_buf->seq_no_inv = ~pkt_no;
+	frame[0].base = &pkt_buf->soh;
+	frame[0].len = 3;
+	crc = 0;
+	if (pl_size == PACKET_PAYLOAD_SIZE_1K) {
+		pkt_buf->soh = STX;
+	} else if (pl_size == PACKET_PAYLOAD_SIZE) {
+		pkt_buf->soh = SOH;
+	} else {
+		/* The length byte follows the header and is covered by the CRC */
+		pkt_buf->soh = SOH_SHORT;
+		pkt_buf->len = pl_size;
+		frame[0].len++;
+		crc = crc_xmodem_update(crc, &pkt_buf->len, 1);
+	}
+	frame_len = frame[0].len + pl_size + 2;
+	n = 1;
+	while (data_len && (cur.idx < cur.iovcnt)) {
+		chunk = cur.iov[cur.idx].len - cur.off;
+		chunk = (chunk > data_len) ? data_len : chunk;
+		frame[n].base = cur.iov[cur.idx].base + cur.off;
+		frame[n].len = chunk;
+		crc = crc_xmodem_update(crc, frame[n].base, chunk);
+		iov_cursor_advance(&cur, chunk);
+		data_len -= chunk;
+		pl_size -= chunk;
+		n++;
+	}
+	xm->stats.tx_frames++;
+	xm->stats.pad_bytes += pl_size;
+	if (pl_size) {
+		frame[n].base = pkt_buf->data;
+		frame[n].len = pl_size;
+		crc = crc_xmodem_update(crc, pkt_buf->data, pl_size);
+		n++;
 	}
+	pkt_buf->crc_u8[0] = (crc >> 8) & 0xFF;
+	pkt_buf->crc_u8[1] = crc & 0xFF;
+	frame[n].base = pkt_buf->crc_u8;
+	frame[n].len = 2;
+	n++;
 
-	return 0;
+	rtt_note_tx(xm, frame_len);
+	return xm->tr->writev(xm->tr_ctx, frame, n);
+}
+
+/*
+ * Wait for the reply to a frame or control byte.
+ *
+ * Bytes that cannot be a reply (line noise) are discarded rather than taken as
+ * a failed attempt. With 'frame_ok' set, the start of a frame is a reply too.
+ *
+ * @param[in]  xm       The XMODEM session.
+ * @param[out] rsp      The reply (ACK, NAK, 'C', CAN or the start of a frame).
+ * @param[in]  frame_ok Whether the start of a frame is a valid reply.
+ *
+ * @return 0 on success, negative error code otherwise (e.g., timeout).
+ */
+static int xmodem_get_reply(xmodem_t *xm, uint8_t *rsp, int frame_ok)
+{
+	int retv;
+
+	while ((retv = xmodem_getc(xm, rsp)) == 0) {
+		if ((*rsp == ACK) || (*rsp == NAK) || (*rsp == 'C') ||
+		    (*rsp == CAN) ||
+		    (frame_ok && ((*rsp == SOH) || (*rsp == STX) ||
+				  (*rsp == SOH_SHORT)))) {
+			break;
+		}
+		xm->stats.junk_bytes++;
+	}
+
+	return retv;
+}
+
+/*
+ * Get the number of times a frame is sent before giving up.
+ *
+ * 1K frames keep the budget of control bytes: a receiver that keeps rejecting
+ * them probably does not support them, and the caller falls back to 128-byte
+ * frames.
+ */
+static uint8_t xmodem_frame_retries(size_t pl_size)
+{
+	return (pl_size == PACKET_PAYLOAD_SIZE_1K) ? MAX_RETRANSMIT
+						   : MAX_RETRANSMIT_FRAME;
 }
 
 /**
- * Try to send an XMODEM packet for MAX_RETRANSMIT times.
+ * Try to send an XMODEM packet for xmodem_frame_retries() times.
  *
  * This function sends an XMODEM packet and checks if an ACK is received. If no
- * ACK is received, the packet is retransmitted. This is done until
- * 'MAX_RETRANSMIT' is exceeded.
+ * ACK is received, the packet is retransmitted. This is done until the number
+ * of attempts is exceeded.
  *
- * @param[in] data     The payload of the packet.
- * @param[in] data_len The length of the payload. Must be at most 128 bytes.
- *		       If less, (random) padding is automatically added.
+ * @param[in] xm       The XMODEM session.
+ * @param[in] data     The position of the payload in the user's buffers.
+ * @param[in] data_len The length of the payload. Must be at most 'pl_size'
+ *		       bytes. If less, (random) padding is automatically added.
+ * @param[in] pl_size  The payload size of the frame (128 or 1024 bytes).
  * @param[in] pkt_no   The packet sequence number.
  *
  * @return Exit status.
- * @retval 0  Success, the packet has been transmitted and an ACK received.
- * @retval -1 Error, retransmit count exceeded.
+ * @retval 0          Success, the packet has been transmitted and an ACK
+ *		      received.
+ * @retval -ETIMEDOUT Error, retransmit count exceeded.
+ * @retval <0         Other negative error code: the packet could not be
+ *		      written.
  */
-static int xmodem_send_pkt_with_retry(const uint8_t *data, size_t data_len,
-									  uint8_t pkt_no)
+static int xmodem_send_pkt_with_retry(xmodem_t *xm, const iov_cursor_t *data,
+				      size_t data_len, size_t pl_size,
+				      uint8_t pkt_no)
 {
-	uint8_t retransmit = MAX_RETRANSMIT;
+	uint8_t attempts = xmodem_frame_retries(pl_size);
+	uint8_t retransmit = attempts;
 	uint8_t rsp;
+	int rc;
 
 	printd("xmodem_send_pkt_with_retry(): pkt_no: %d\n", pkt_no);
 	while (retransmit--) {
-		xmodem_send_pkt(data, data_len, pkt_no);
-		rsp = ERR;
-		xmodem_getc(&rsp);
+		if (retransmit != attempts - 1) {
+			xm->stats.retransmits++;
+		}
+		/*
+		 * Replies already received are stale (e.g., several ACKs of
+		 * a frame sent again because the first ACK was late): only
+		 * the reply following this frame counts.
+		 */
+		xm->stats.junk_bytes += xm->rx_tail - xm->rx_head;
+		xm->rx_head = xm->rx_tail;
+		rc = xmodem_send_pkt(xm, data, data_len, pl_size, pkt_no);
+		if (rc < 0) {
+			return rc;
+		}
+		rtt_set_timeout(xm);
+		if (xmodem_get_reply(xm, &rsp, 0) < 0) {
+			rsp = ERR;
+			rtt_backoff(xm);
+		}
+		xm->stats.naks_received += (rsp == NAK);
 		if (rsp == ACK) {
 			printd("xmodem_send_pkt_with_retry(): done\n");
+			if (retransmit == attempts - 1) {
+				rtt_sample(xm, xm->rtt.tx_done);
+			}
 			return 0;
 		}
 		printd("xmodem_send_pkt_with_retry(): failure (%d) 0x%02x\n",
 			   retransmit, rsp);
 	}
 
-	return -1;
+	return -ETIMEDOUT;
 }
 
 /**
@@ -193,22 +564,43 @@ static int xmodem_send_pkt_with_retry(const uint8_t *data, size_t data_len,
  * an ACK is received. If no ACK is received, the byte is retransmitted. This is
  * done until 'MAX_RETRANSMIT' is exceeded.
  *
+ * @param[in] xm  The XMODEM session.
  * @param[in] cmd The byte to send.
  *
  * @return Exit status.
  * @retval 0  Success, the byte has been transmitted and an ACK received.
  * @retval -1 Error, retransmit count exceeded.
  */
-static int xmodem_send_byte_with_retry(uint8_t cmd)
+static int xmodem_send_byte_with_retry(xmodem_t *xm, uint8_t cmd)
 {
 	uint8_t retransmit = MAX_RETRANSMIT;
 	uint8_t rsp;
 
 	while (retransmit--) {
-		xmodem_putc(&cmd);
-		rsp = ERR;
-		xmodem_getc(&rsp);
+		if (retransmit != MAX_RETRANSMIT - 1) {
+			xm->stats.retransmits++;
+		}
+		rtt_note_tx(xm, 1);
+		xmodem_putc(xm, &cmd);
+		rtt_set_timeout(xm);
+		if (xmodem_get_reply(xm, &rsp,
+				     (cmd == EOT) && xm->turnaround) < 0) {
+			rsp = ERR;
+			rtt_backoff(xm);
+		}
+		xm->stats.naks_received += (rsp == NAK);
+		if ((rsp == SOH) || (rsp == STX) || (rsp == SOH_SHORT)) {
+			/*
+			 * The ACK got lost, but the receiver is already
+			 * answering: leave the frame to xmodem_receive().
+			 */
+			xm->rx_head--;
+			rsp = ACK;
+		}
 		if (rsp == ACK) {
+			if (retransmit == MAX_RETRANSMIT - 1) {
+				rtt_sample(xm, xm->rtt.tx_done);
+			}
 			return 0;
 		}
 		printd("xmodem_send_pkt_with_retry(): failure (%d) 0x%02x\n",
@@ -218,13 +610,117 @@ static int xmodem_send_byte_with_retry(uint8_t cmd)
 	return -1;
 }
 
+/*
+ * Make sure that at least 'n' bytes are in the receive buffer.
+ *
+ * The pending bytes are moved to the start of the buffer if needed, and more
+ * are read from the transport (with the timeout set by xmodem_set_timeout())
+ * until there are enough.
+ *
+ * @param[in] xm The XMODEM session.
+ * @param[in] n  The number of bytes needed (at most XMODEM_RX_BUF_SIZE).
+ *
+ * @return 0 on success, negative error code otherwise.
+ * @retval -ETIMEDOUT in case of timeout.
+ * @retval -EIO       in case of I/O error.
+ */
+static int xmodem_rx_fill(xmodem_t *xm, size_t n)
+{
+	int retv;
+
+	while (xm->rx_tail - xm->rx_head < n) {
+		if (xm->rx_head) {
+			memmove(xm->rx_buf, &xm->rx_buf[xm->rx_head],
+				xm->rx_tail - xm->rx_head);
+			xm->rx_tail -= xm->rx_head;
+			xm->rx_head = 0;
+		}
+		retv = xm->tr->read(xm->tr_ctx, &xm->rx_buf[xm->rx_tail],
+				    sizeof(xm->rx_buf) - xm->rx_tail);
+		if (retv < 0) {
+			xm->stats.timeouts += (retv == -ETIMEDOUT);
+			return retv;
+		}
+		xm->rx_tail += retv;
+	}
+
+	return 0;
+}
+
+/*
+ * Check the sequence number and its complement following a frame start.
+ *
+ * Only the expected sequence number and the previous one (a retransmission)
+ * are plausible.
+ */
+static int xmodem_seq_plausible(const uint8_t *b, uint8_t exp_seq_no)
+{
+	return ((b[0] == exp_seq_no) || (b[0] == (uint8_t)(exp_seq_no - 1))) &&
+	       (b[0] == (~b[1] & 0xFF));
+}
+
+/*
+ * Look for the header of a frame in the incoming bytes.
+ *
+ * A header is an SOH / STX / SOH_SHORT followed by a plausible sequence
+ * number and its complement, which makes a false match within payload data
+ * unlikely.
+ * The bytes preceding the header are discarded in bulk from the receive
+ * buffer; the header itself is left there, so that the frame can be read as
+ * usual.
+ *
+ * The search stops when the line remains quiet for the drain timeout.
+ *
+ * @param[in] xm         The XMODEM session.
+ * @param[in] exp_seq_no The expected sequence number.
+ *
+ * @return 0 if a header has been found, negative error code otherwise.
+ */
+static int xmodem_resync(xmodem_t *xm, uint8_t exp_seq_no)
+{
+	const uint8_t *b;
+	size_t i;
+	int retv;
+
+	xmodem_set_timeout(xm, rtt_drain_timeout(xm));
+	while ((retv = xmodem_rx_fill(xm, 3)) == 0) {
+		b = xm->rx_buf;
+		for (i = xm->rx_head; i + 3 <= xm->rx_tail; i++) {
+			if (((b[i] == SOH) || (b[i] == STX) ||
+			     (b[i] == SOH_SHORT)) &&
+			    xmodem_seq_plausible(&b[i + 1], exp_seq_no)) {
+				printd("xmodem_resync(): skipped %d bytes\n",
+				       (int)(i - xm->rx_head));
+				xm->stats.junk_bytes += i - xm->rx_head;
+				xm->rx_head = i;
+				return 0;
+			}
+		}
+		/* Keep the last bytes: they may be the start of a header */
+		xm->stats.junk_bytes += i - xm->rx_head;
+		xm->rx_head = i;
+	}
+	/* The sender stopped: what is left is garbage too */
+	xm->stats.junk_bytes += xm->rx_tail - xm->rx_head;
+	xm->rx_head = xm->rx_tail;
+
+	return retv;
+}
+
 /*
  * Receive an XMODEM packet.
  *
- * @param[in] exp_seq_no The expected sequence number of the packet to be
- * 			 received.
- * @param[in] data       The buffer where to store the packet payload.
- * @param[in] len        The size of the buffer.
+ * The payload of the expected packet is stored directly in the user's
+ * buffers; the payload of any other packet is discarded.
+ *
+ * @param[in]  xm         The XMODEM session.
+ * @param[in]  exp_seq_no The expected sequence number of the packet to be
+ * 			  received.
+ * @param[in]  data       The position where to store the packet payload in
+ *			  the user's buffers.
+ * @param[out] rx_len     The size of the received payload (128 bytes for an
+ *			  SOH frame, 1024 bytes for an STX frame, the length
+ *			  field for a short frame).
  *
  * @return Status code.
  * @retval SOH The packet has been successful received.
@@ -239,23 +735,49 @@ static int xmodem_send_byte_with_retry(uint8_t cmd)
  * @retval EOT The sender notified the end of transmission (i.e., there are no
  *	       more packets to receive).
  */
-static int xmodem_read_pkt(uint8_t exp_seq_no, uint8_t *data, size_t len)
+static int xmodem_read_pkt(xmodem_t *xm, uint8_t exp_seq_no,
+			   const iov_cursor_t *data, size_t *rx_len)
 {
+	xmodem_packet_t *pkt_buf = &xm->pkt_buf;
 	uint8_t cmd;
+	size_t pl_size;
 	uint16_t crc_recv; /* received CRC */
 	uint16_t crc_comp; /* computed CRC */
+	iov_cursor_t cur;
 	uint8_t *buf;
-	uint8_t *buf_end;
+	size_t i;
+	int land;
 
 	cmd = ERR;
 
-	if (xmodem_getc(&cmd) < 0) {
+	if (xmodem_getc(xm, &cmd) < 0) {
 		return ERR;
 	}
+	/*
+	 * A frame start not followed by a plausible sequence number is a
+	 * payload byte of a frame whose header was damaged: reading a whole
+	 * frame from there would swallow the retransmission as well.
+	 */
+	if (((cmd == SOH) || (cmd == STX) || (cmd == SOH_SHORT)) &&
+	    ((xmodem_rx_fill(xm, 2) < 0) ||
+	     !xmodem_seq_plausible(&xm->rx_buf[xm->rx_head], exp_seq_no))) {
+		printd("xmodem_read_pkt(): cmd: 0x%x without header\n", cmd);
+		cmd = ERR;
+	}
 
 	switch (cmd) {
 	case SOH:
 		printd("xmodem_read_pkt(): cmd: SOH\n");
+		pl_size = PACKET_PAYLOAD_SIZE;
+		break;
+	case STX:
+		printd("xmodem_read_pkt(): cmd: STX\n");
+		pl_size = PACKET_PAYLOAD_SIZE_1K;
+		break;
+	case SOH_SHORT:
+		printd("xmodem_read_pkt(): cmd: SOH_SHORT\n");
+		/* The payload size follows the sequence number */
+		pl_size = 0;
 		break;
 	case EOT:
 		printd("xmodem_read_pkt(): cmd: EOT\n");
@@ -264,79 +786,125 @@ static int xmodem_read_pkt(uint8_t exp_seq_no, uint8_t *data, size_t len)
 		/*
 		 * Unexpected cmd case.
 		 *
-		 * This includes the case of a corrupted/lost SOH; therefore,
-		 * we should check if other bytes are arriving and, in case,
-		 * discard them before returning (and replying with a NAK).
-		 *
-		 * This is the purpose of the following loop.
+		 * This includes the case of a corrupted/lost SOH; rather than
+		 * waiting for the sender to stop and then NAKing the frame,
+		 * look for the next frame header in the incoming bytes and
+		 * resume from there (returning ERR, i.e., replying with a NAK,
+		 * only if the line goes quiet first).
 		 */
 		printd("xmodem_read_pkt(): cmd: unexpected ctrl byte (0x%x)\n", cmd);
-		/* Wait until the sender stops sending bytes. We change timeout value
-		 * for the next loop */
-		xmodem_set_timeout(TIMEOUT_ERR);
-		while (xmodem_getc(&cmd) >= 0)
-			;
-		xmodem_set_timeout(TIMEOUT_STD);
-		return ERR;
+		xm->stats.junk_bytes++;
+		if (xmodem_resync(xm, exp_seq_no) < 0) {
+			return ERR;
+		}
+		xmodem_getc(xm, &cmd);
+		pl_size = (cmd == STX) ? PACKET_PAYLOAD_SIZE_1K
+			  : (cmd == SOH) ? PACKET_PAYLOAD_SIZE
+			  : 0;
 	}
 
 	/* Read the rest of the packet (seq_no, ~seq_no, data, and CRC) */
 	/* Start from seq_no, since we have already read SOH */
-	buf = (uint8_t *)&pkt_buf.seq_no;
-	/* Compute end of buffer */
-	buf_end = (uint8_t *)(&pkt_buf + 1);
-	while (buf < buf_end) {
-		if (xmodem_getc(buf++) < 0) {
+	if ((xmodem_getc(xm, &pkt_buf->seq_no) < 0) ||
+	    (xmodem_getc(xm, &pkt_buf->seq_no_inv) < 0)) {
+		printd("xmodem_read_pkt(): pkt: ERROR: timeout\n");
+		return ERR;
+	}
+	crc_comp = 0;
+	if (!pl_size) {
+		if (xmodem_getc(xm, &pkt_buf->len) < 0) {
+			printd("xmodem_read_pkt(): pkt: ERROR: timeout\n");
+			return ERR;
+		}
+		if (!pkt_buf->len || (pkt_buf->len >= PACKET_PAYLOAD_SIZE)) {
+			printd("xmodem_read_pkt(): pkt: ERROR: bad length\n");
+			return ERR;
+		}
+		pl_size = pkt_buf->len;
+		crc_comp = crc_xmodem_update(crc_comp, &pkt_buf->len, 1);
+	}
+	/*
+	 * The payload goes straight to the user's buffers only if this looks
+	 * like the expected packet and it fits; otherwise it is discarded.
+	 */
+	cur = *data;
+	land = (pkt_buf->seq_no == exp_seq_no) &&
+	       (pkt_buf->seq_no_inv == (~exp_seq_no & 0xFF)) &&
+	       (iov_cursor_left(&cur) >= pl_size);
+	/* Update the CRC as the payload arrives */
+	for (i = 0; i < pl_size; i++) {
+		buf = land ? &cur.iov[cur.idx].base[cur.off] : &pkt_buf->data[i];
+		if (xmodem_getc(xm, buf) < 0) {
 			printd("xmodem_read_pkt(): pkt: ERROR: timeout\n");
 			printd("----\n");
 			/* This is a timeout error */
 			return ERR;
 		}
+		crc_comp = crc_xmodem_update(crc_comp, buf, 1);
+		if (land) {
+			iov_cursor_advance(&cur, 1);
+		}
+	}
+	if ((xmodem_getc(xm, &pkt_buf->crc_u8[0]) < 0) ||
+	    (xmodem_getc(xm, &pkt_buf->crc_u8[1]) < 0)) {
+		printd("xmodem_read_pkt(): pkt: ERROR: timeout\n");
+		return ERR;
 	}
 
 	/* Check sequence number fields and CRC */
-	crc_comp = crc_xmodem();
-	crc_recv = (pkt_buf.crc_u8[0] << 8) | pkt_buf.crc_u8[1];
+	crc_recv = (pkt_buf->crc_u8[0] << 8) | pkt_buf->crc_u8[1];
 	/*
 	 * NOTE: Using 'a == (~a &FF)' instead of 'a == ~a', since the latter
 	 * leads to a compilation error due to the following GCC bug:
 	 * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=38341
 	 */
-	if ((pkt_buf.seq_no != (~pkt_buf.seq_no_inv & 0xFF)) ||
+	if ((pkt_buf->seq_no != (~pkt_buf->seq_no_inv & 0xFF)) ||
 		(crc_recv != crc_comp)) {
 		printd("xmodem_read_pkt(): pkt: ERROR: corrupted packet\n");
+		xm->stats.crc_errors++;
 		return ERR;
 	}
 	/* Check packet numbers. */
-	if ((pkt_buf.seq_no == (exp_seq_no - 1))) {
+	if ((pkt_buf->seq_no == (exp_seq_no - 1))) {
 		printd("xmodem_read_pkt(): pkt: WARNING duplicated packet\n");
 		return DUP;
 	}
-	if (pkt_buf.seq_no != exp_seq_no) {
+	if (pkt_buf->seq_no != exp_seq_no) {
 		printd("xmodem_read_pkt(): pkt: ERROR: wrong seq number\n");
 		return CAN;
 	}
 
 	/*
 	 * If we reach this point, the packet is the expected one and it has
-	 * been correctly received: now we can check that the buffer is big
+	 * been correctly received: now we can check that the buffer was big
 	 * enough to hold the payload (NOTE: this check should not be
 	 * anticipated, otherwise we risk to return a CAN in case of a simple
 	 * EOT from the sender).
 	 */
-	if (len < sizeof(pkt_buf.data)) {
+	if (!land) {
 		printd("xmodem_read_pkt(): pkt: "
 			   "ERROR: user buffer out of space\n");
 		return CAN;
 	}
-	memcpy(data, pkt_buf.data, sizeof(pkt_buf.data));
+	*rx_len = pl_size;
 	printd("xmodem_read_pkt(): pkt: received correctly\n");
 
 	return SOH;
 }
 
-int xmodem_receive_package(uint8_t *buf, size_t buf_len)
+int xmodem_receive_package(xmodem_t *xm, uint8_t *buf, size_t buf_len)
 {
+	xmodem_iovec_t iov;
+
+	iov.base = buf;
+	iov.len = buf_len;
+
+	return xmodem_receive_iov(xm, &iov, 1);
+}
+
+int xmodem_receive_iov(xmodem_t *xm, const xmodem_iovec_t *iov, int iovcnt)
+{
+	iov_cursor_t cur;
 	int status;
 	uint8_t exp_seq_no;
 	uint8_t nak;
@@ -344,13 +912,22 @@ int xmodem_receive_package(uint8_t *buf, size_t buf_len)
 	int retv;
 	int data_cnt;
 	int err_cnt;
+	size_t rx_len;
 
-	xmodem_set_timeout(TIMEOUT_STD);
+	if (iovcnt > XMODEM_MAX_IOV) {
+		return -1;
+	}
+	iov_cursor_init(&cur, iov, iovcnt, 0);
+	xmodem_set_timeout(xm, TIMEOUT_STD);
 
 	/* XMODEM sequence number starts from 1 */
 	exp_seq_no = 1;
-	/* Reception is started by sending a 'C' */
-	cmd = 'C';
+	/*
+	 * Reception is started by sending a 'C', unless the sender is
+	 * already sending (turnaround mode).
+	 */
+	cmd = xm->peer_sending ? 0 : 'C';
+	xm->peer_sending = 0;
 	/*
 	 * Until the first packet is received (i.e., the XMODEM transfer is
 	 * started), we must nak with a 'C' instead of a regular NAK
@@ -362,18 +939,34 @@ int xmodem_receive_package(uint8_t *buf, size_t buf_len)
 	data_cnt = 0;
 	retv = -1;
 	while (err_cnt < MAX_RX_ERRORS) {
-		printd("xmodem_receive(): sending cmd: %x\n", cmd);
-		xmodem_putc(&cmd);
-		status = xmodem_read_pkt(exp_seq_no, &buf[data_cnt], buf_len);
+		if (cmd) {
+			printd("xmodem_receive(): sending cmd: %x\n", cmd);
+			xm->stats.naks_sent += (cmd == NAK);
+			rtt_note_tx(xm, 1);
+			xmodem_putc(xm, &cmd);
+		}
+		/*
+		 * The sender may need some time to process our request before
+		 * sending the first packet; the following ones are expected
+		 * within the RTO.
+		 */
+		if (nak == 'C') {
+			xmodem_set_timeout(xm, TIMEOUT_STD);
+		} else {
+			rtt_set_timeout(xm);
+		}
+		status = xmodem_read_pkt(xm, exp_seq_no, &cur, &rx_len);
 		switch (status) {
 		case SOH:
+			xm->stats.rx_frames++;
 			nak = NAK;
-			data_cnt += sizeof(pkt_buf.data);
-			buf_len -= sizeof(pkt_buf.data);
+			data_cnt += rx_len;
+			iov_cursor_advance(&cur, rx_len);
 			exp_seq_no++;
 			err_cnt = 0;
 		/* no 'break' on purpose */
 		case DUP:
+			xm->stats.duplicates += (status == DUP);
 			/*
 			 * We must acknowledge duplicated packets to have the
 			 * sender transmit the next packet
@@ -388,6 +981,9 @@ int xmodem_receive_package(uint8_t *buf, size_t buf_len)
 			cmd = CAN;
 			goto exit;
 		default:
+			if (nak != 'C') {
+				rtt_backoff(xm);
+			}
 			err_cnt++;
 			cmd = nak;
 		}
@@ -396,25 +992,238 @@ exit:
 	if (retv < 0) {
 		printd("xmodem_receive(): ERROR: reception failed\n");
 	}
-	xmodem_putc(&cmd);
+	xmodem_putc(xm, &cmd);
 
 	return retv;
 }
 
-int xmodem_transmit_package(uint8_t *data, size_t len)
+/**
+ * Send XMODEM packets using a sliding window.
+ *
+ * Up to 'xm->tx_window' frames are sent without waiting for the receiver's
+ * response. In this mode the receiver follows every ACK / NAK with the
+ * sequence number it refers to:
+ * - 'ACK n' acknowledges all the frames up to (and including) frame 'n';
+ * - 'NAK n' reports that frame 'n' was lost or corrupted (all the previous
+ *   frames are acknowledged).
+ *
+ * On a NAK, or if no valid response is received before the timeout, all the
+ * outstanding frames are retransmitted starting from the first unacknowledged
+ * one (go-back-N).
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] iov    The data to send.
+ * @param[in] iovcnt The number of segments of the data.
+ * @param[in] len    The total length of the data.
+ *
+ * @return Number of bytes actually transmitted (including padding) on success,
+ * 	   negative error code otherwise.
+ * @retval >0 Number of sent bytes (including padding).
+ * @retval -1 Error (number of retries exceeded).
+ * @retval <0 Other negative error code: a frame could not be written.
+ */
+static int xmodem_transmit_windowed(xmodem_t *xm, const xmodem_iovec_t *iov,
+				    int iovcnt, size_t len)
+{
+	iov_cursor_t cur;
+	struct {
+		size_t off;
+		size_t len;
+		size_t pl_size;
+		/* Time the frame is expected to have left the wire */
+		uint64_t tx_done;
+		/* Whether the frame has been sent more than once */
+		int resent;
+	} frm[XMODEM_MAX_WINDOW], *f;
+	size_t next_off;
+	uint8_t base;
+	uint8_t next;
+	uint8_t failures;
+	uint8_t stale;
+	uint8_t rsp;
+	uint8_t seq;
+	int sent;
+	int rc;
+
+	/* Sequence number of the oldest unacknowledged frame */
+	base = 1;
+	/* Sequence number and data offset of the next frame to send */
+	next = 1;
+	next_off = 0;
+	sent = 0;
+	failures = 0;
+	stale = 0;
+	memset(frm, 0, sizeof(frm));
+
+	while ((base != next) || (next_off < len)) {
+		/* Fill the window */
+		while (((uint8_t)(next - base) < xm->tx_window) && (next_off < len)) {
+			f = &frm[next % XMODEM_MAX_WINDOW];
+			f->resent = (f->off == next_off) && f->tx_done;
+			xm->stats.retransmits += f->resent;
+			f->off = next_off;
+			f->pl_size = xmodem_frame_size(xm, len - next_off);
+			f->len = ((len - next_off) >= f->pl_size)
+				     ? f->pl_size
+				     : (len - next_off);
+			iov_cursor_init(&cur, iov, iovcnt, f->off);
+			rc = xmodem_send_pkt(xm, &cur, f->len, f->pl_size,
+					     next);
+			if (rc < 0) {
+				return rc;
+			}
+			f->tx_done = xm->rtt.tx_done;
+			next_off += f->len;
+			next++;
+		}
+
+		rtt_set_timeout(xm);
+		seq = 0;
+		if (xmodem_get_reply(xm, &rsp, 0) < 0) {
+			rsp = ERR;
+			rtt_backoff(xm);
+		} else if (((rsp == ACK) || (rsp == NAK)) &&
+		    (xmodem_getc(xm, &seq) == 0) &&
+		    ((uint8_t)(seq - base) < (uint8_t)(next - base))) {
+			xm->stats.naks_received += (rsp == NAK);
+			/* Frames before 'seq' (or up to it, for an ACK) are in */
+			if (rsp == ACK) {
+				f = &frm[seq % XMODEM_MAX_WINDOW];
+				if (!f->resent) {
+					rtt_sample(xm, f->tx_done);
+				}
+				seq++;
+			}
+			while (base != seq) {
+				sent += frm[base % XMODEM_MAX_WINDOW].pl_size;
+				base++;
+				failures = 0;
+				stale = 0;
+			}
+			if (rsp == ACK) {
+				continue;
+			}
+		} else if (((rsp == ACK) || (rsp == NAK)) &&
+			   (++stale <= XMODEM_MAX_WINDOW)) {
+			/*
+			 * Stale response to an already acknowledged frame (a
+			 * go-back produces up to a window of them). More are
+			 * treated as an error: the receiver does not follow
+			 * ACK / NAK with a sequence number.
+			 */
+			printd("xmodem_transmit_windowed(): ignoring 0x%02x %d\n",
+			       rsp, seq);
+			continue;
+		}
+
+		printd("xmodem_transmit_windowed(): go back to %d (0x%02x)\n",
+		       base, rsp);
+		stale = 0;
+		f = &frm[base % XMODEM_MAX_WINDOW];
+		if (++failures > xmodem_frame_retries(f->pl_size)) {
+			if (f->pl_size != PACKET_PAYLOAD_SIZE_1K) {
+				return -1;
+			}
+			/* Same 1K fallback as for stop-and-wait transfers */
+			xm->use_1k = 0;
+			failures = 0;
+		}
+		next = base;
+		next_off = f->off;
+	}
+
+	return sent;
+}
+
+void xmodem_init(xmodem_t *xm, const transport_t *tr, void *tr_ctx)
+{
+	memset(xm, 0, sizeof(*xm));
+	xm->tr = tr;
+	xm->tr_ctx = tr_ctx;
+	xm->tx_window = 1;
+	xm->rtt.rto = RTO_MAX;
+}
+
+void xmodem_set_1k(xmodem_t *xm, int enable)
+{
+	xm->use_1k = enable;
+}
+
+void xmodem_set_short(xmodem_t *xm, int enable)
+{
+	xm->use_short = enable;
+}
+
+void xmodem_get_stats(const xmodem_t *xm, xmodem_stats_t *stats)
+{
+	*stats = xm->stats;
+	stats->srtt_us = xm->rtt.srtt;
+}
+
+void xmodem_flush(xmodem_t *xm)
+{
+	xm->rx_head = 0;
+	xm->rx_tail = 0;
+	xm->peer_sending = 0;
+}
+
+void xmodem_set_max_timeout(xmodem_t *xm, int ms)
 {
+	xm->max_timeout = ms;
+}
+
+void xmodem_set_turnaround(xmodem_t *xm, int enable)
+{
+	xm->turnaround = enable;
+	xm->peer_sending = 0;
+}
+
+int xmodem_set_window(xmodem_t *xm, unsigned int frames)
+{
+	if ((frames < 1) || (frames > XMODEM_MAX_WINDOW)) {
+		return -EINVAL;
+	}
+	xm->tx_window = frames;
+
+	return 0;
+}
+
+int xmodem_transmit_package(xmodem_t *xm, uint8_t *data, size_t len)
+{
+	xmodem_iovec_t iov;
+
+	iov.base = data;
+	iov.len = len;
+
+	return xmodem_transmit_iov(xm, &iov, 1);
+}
+
+int xmodem_transmit_iov(xmodem_t *xm, const xmodem_iovec_t *iov, int iovcnt)
+{
+	iov_cursor_t cur;
+	size_t len;
 	int mlen;
+	int sent;
+	int rc;
+	size_t pl_size;
 	uint8_t retransmit;
 	uint8_t rsp;
 	uint8_t pkt_no;
 
-	xmodem_set_timeout(TIMEOUT_STD);
+	if (iovcnt > XMODEM_MAX_IOV) {
+		return -1;
+	}
+	iov_cursor_init(&cur, iov, iovcnt, 0);
+	len = iov_cursor_left(&cur);
+	xm->peer_sending = 0;
+
+	xmodem_set_timeout(xm, TIMEOUT_STD);
 	retransmit = MAX_RETRANSMIT;
 
 	while (retransmit--) {
 		printd("xmodem_transmit(): waiting for 'C' (%d)\n", retransmit);
 		rsp = ERR;
-		xmodem_getc(&rsp);
+		xmodem_getc(xm, &rsp);
 		if (rsp == 'C') {
 			goto start_transmit;
 		}
@@ -424,20 +1233,47 @@ int xmodem_transmit_package(uint8_t *data, size_t len)
 
 start_transmit:
 	printd("xmodem_transmit(): starting transmission\n");
+	if (xm->tx_window > 1) {
+		sent = xmodem_transmit_windowed(xm, iov, iovcnt, len);
+		if (sent < 0) {
+			return -1;
+		}
+		len = 0;
+	} else {
+		sent = 0;
+	}
 	pkt_no = 1;
 	/* Send packets as long data */
 	while (len) {
-		mlen = (len >= sizeof(pkt_buf.data)) ? sizeof(pkt_buf.data) : len;
-		if (xmodem_send_pkt_with_retry(data, mlen, pkt_no) < 0) {
-			return -1;
+		pl_size = xmodem_frame_size(xm, len);
+		mlen = (len >= pl_size) ? pl_size : len;
+		rc = xmodem_send_pkt_with_retry(xm, &cur, mlen, pl_size,
+						pkt_no);
+		if (rc < 0) {
+			if ((rc != -ETIMEDOUT) ||
+			    (pl_size != PACKET_PAYLOAD_SIZE_1K)) {
+				return -1;
+			}
+			/*
+			 * The receiver keeps rejecting 1K frames: it probably
+			 * does not support them. Fall back to 128-byte frames
+			 * (re-using the same sequence number) for the rest of
+			 * the session.
+			 */
+			printd("xmodem_transmit(): falling back to 128-byte "
+			       "frames\n");
+			xm->use_1k = 0;
+			continue;
 		}
-		data += mlen;
+		iov_cursor_advance(&cur, mlen);
 		len -= mlen;
+		sent += pl_size;
 		pkt_no++;
 	}
-	if (xmodem_send_byte_with_retry(EOT) < 0) {
+	if (xmodem_send_byte_with_retry(xm, EOT) < 0) {
 		return -1;
 	}
+	xm->peer_sending = xm->turnaround;
 
-	return (pkt_no - 1) * 128;
+	return sent;
 }
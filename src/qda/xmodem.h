@@ -22,18 +22,169 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include "transport.h"
 
 /** XMODEM block size */
 #define XMODEM_BLOCK_SIZE (128)
 
+/** XMODEM-1K block size */
+#define XMODEM_1K_BLOCK_SIZE (1024)
+
+/**
+ * XMODEM short frame control byte.
+ *
+ * Short frames are an extension carrying less than XMODEM_BLOCK_SIZE bytes
+ * with no padding: SOH_SHORT, seq, ~seq, len, len bytes of data, CRC. The CRC
+ * covers the length byte too.
+ */
+#define XMODEM_SOH_SHORT (0x03)
+
 /* The maximum number of times XMODEM tries to send a packet / control byte */
 #define MAX_RETRANSMIT (3)
 
+/*
+ * The maximum number of times XMODEM tries to send a frame of up to 128 bytes:
+ * a single lost byte costs two attempts (timeout, then NAK).
+ */
+#define MAX_RETRANSMIT_FRAME (10)
+
+/** The maximum number of unacknowledged frames in windowed transmit mode */
+#define XMODEM_MAX_WINDOW (16)
+
+/** The maximum number of segments in a scatter-gather list */
+#define XMODEM_MAX_IOV (8)
+
+/** Size of the receive buffer; big enough for a full XMODEM-1K frame */
+#define XMODEM_RX_BUF_SIZE (2048)
+
+/**
+ * A segment of a scatter-gather list.
+ */
+typedef transport_iovec_t xmodem_iovec_t;
+
+/**
+ * The XMODEM packet buffer.
+ *
+ * It holds the header and CRC of incoming and outgoing packets; the payload is
+ * sent from / received into the user's buffers directly. The data field is
+ * only used as a source of padding bytes and as a scratch area for payloads
+ * that must be discarded.
+ */
+typedef struct __attribute__((__packed__)) {
+	uint8_t soh;
+	uint8_t seq_no;
+	uint8_t seq_no_inv;
+	/* Only sent in short frames */
+	uint8_t len;
+	uint8_t data[XMODEM_1K_BLOCK_SIZE];
+	uint8_t crc_u8[2];
+} xmodem_packet_t;
+
+/**
+ * Round-trip time estimation.
+ *
+ * The round-trip time is measured from the moment the last byte of a frame is
+ * expected to have left the wire to the reception of the response. The
+ * retransmission timeout is derived from it as in TCP (RFC 6298): smoothed
+ * RTT plus four times its variation.
+ */
+typedef struct {
+	/** Smoothed round-trip time, in microseconds (0 if no sample yet). */
+	uint32_t srtt;
+	/** Round-trip time variation, in microseconds. */
+	uint32_t rttvar;
+	/** Retransmission timeout, in milliseconds. */
+	int rto;
+	/** Time at which the last byte written is expected to leave the wire. */
+	uint64_t tx_done;
+} xmodem_rtt_t;
+
+/**
+ * XMODEM statistics.
+ *
+ * They are collected from the initialization of the session.
+ */
+typedef struct {
+	/** Number of frames sent (retransmissions included). */
+	unsigned long tx_frames;
+	/** Number of frames / control bytes sent again. */
+	unsigned long retransmits;
+	/** Number of NAKs received. */
+	unsigned long naks_received;
+	/** Number of new frames received. */
+	unsigned long rx_frames;
+	/** Number of duplicate frames received. */
+	unsigned long duplicates;
+	/** Number of corrupted frames received (CRC or sequence number). */
+	unsigned long crc_errors;
+	/** Number of NAKs sent. */
+	unsigned long naks_sent;
+	/** Number of read timeouts. */
+	unsigned long timeouts;
+	/** Number of unexpected bytes dropped while waiting for a frame. */
+	unsigned long junk_bytes;
+	/** Number of padding bytes sent. */
+	unsigned long pad_bytes;
+	/** Smoothed round-trip time of the responses, in microseconds. */
+	unsigned long srtt_us;
+} xmodem_stats_t;
+
+/**
+ * An XMODEM session.
+ *
+ * It holds the whole state of the XMODEM link with one device, so that
+ * several devices can be driven at the same time. It must be initialized with
+ * xmodem_init(); its fields are private to XMODEM.
+ */
+typedef struct {
+	/** The transport XMODEM runs on. */
+	const transport_t *tr;
+	/** The context of the transport. */
+	void *tr_ctx;
+	/**
+	 * Receive buffer.
+	 *
+	 * Bytes are handed out from this buffer, which is refilled with a
+	 * single read of everything the transport has available only when it
+	 * is empty.
+	 */
+	uint8_t rx_buf[XMODEM_RX_BUF_SIZE];
+	size_t rx_head;
+	size_t rx_tail;
+	/** Whether XMODEM-1K (STX) frames are used when transmitting. */
+	int use_1k;
+	/** Whether short frames are used when transmitting. */
+	int use_short;
+	/** Whether the peer answers a transmission without waiting for 'C'. */
+	int turnaround;
+	/** Whether the peer is expected to be sending already (turnaround). */
+	int peer_sending;
+	/** Number of frames that can be sent without waiting for an ACK. */
+	unsigned int tx_window;
+	/** Upper bound of all the timeouts, in milliseconds (0: none). */
+	int max_timeout;
+	/** Round-trip time estimation. */
+	xmodem_rtt_t rtt;
+	/** Statistics. */
+	xmodem_stats_t stats;
+	/** Packet buffer. */
+	xmodem_packet_t pkt_buf;
+} xmodem_t;
+
 /**
  * @defgroup groupXMODEM XMODEM
  * @{
  */
 
+/**
+ * Initialize an XMODEM session.
+ *
+ * @param[out] xm     The session to initialize.
+ * @param[in]  tr     The transport (e.g., a serial port) to run on.
+ * @param[in]  tr_ctx The context of the transport, as returned by its open().
+ */
+void xmodem_init(xmodem_t *xm, const transport_t *tr, void *tr_ctx);
+
 /**
  * Switch XMODEM to receive mode.
  *
@@ -42,16 +193,38 @@
  *
  * This function is blocking and it does not timeout.
  *
+ * @param[in]  xm       The XMODEM session.
  * @param[out] buf      Buffer where to store the received data.
  * @param[in]  buf_size The size of the buffer.
  *
+ * 128-byte (SOH), 1024-byte (STX) and short frames are accepted.
+ *
  * @return Number of received bytes or negative error code. Note that XMODEM
- *         may add up to 127 padding bytes at the end of the real data.
+ *         may add up to 127 (1023 for XMODEM-1K) padding bytes at the end of
+ *         the real data, unless the sender uses short frames.
  * @retval >0 Number of received bytes (including padding).
  * @retval -1 Error (either the reception failed for an unrecoverable protocol
  * 	      error or the provided buffer is too small)
  */
-int xmodem_receive_package(uint8_t *buf, size_t buf_size);
+int xmodem_receive_package(xmodem_t *xm, uint8_t *buf, size_t buf_size);
+
+/**
+ * Switch XMODEM to receive mode, scattering data into a list of buffers.
+ *
+ * Same as xmodem_receive_package(), but the received data is stored directly
+ * (i.e., without intermediate copies) into the passed segments, in order.
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] iov    The list of buffers where to store the received data.
+ * @param[in] iovcnt The number of segments in the list (at most
+ * 		     XMODEM_MAX_IOV).
+ *
+ * @return Number of received bytes or negative error code.
+ * @retval >0 Number of received bytes (including padding).
+ * @retval -1 Error (either the reception failed for an unrecoverable protocol
+ * 	      error or the provided buffers are too small)
+ */
+int xmodem_receive_iov(xmodem_t *xm, const xmodem_iovec_t *iov, int iovcnt);
 
 /**
  * Switch XMODEM to transmit mode.
@@ -60,8 +233,15 @@ int xmodem_receive_package(uint8_t *buf, size_t buf_size);
  * package content is sent in 128 bytes frames. Extra (padding) data is added
  * to the last frame if the data size is not multiple of 128 bytes.
  *
+ * If XMODEM-1K is enabled (see xmodem_set_1k()), 1024 bytes frames are used
+ * as long as at least 1024 bytes are left to send.
+ *
+ * If a transmit window bigger than one frame is set (see xmodem_set_window()),
+ * frames are streamed without waiting for each ACK.
+ *
  * This function is blocking, but may timeout.
  *
+ * @param[in] xm   The XMODEM session.
  * @param[in] data The data to send.
  * @param[in] len  The length of the data.
  *
@@ -70,7 +250,131 @@ int xmodem_receive_package(uint8_t *buf, size_t buf_size);
  * @retval >0 Number of sent bytes (including padding).
  * @retval -1 Error (timeout or number of retries exceeded).
  */
-int xmodem_transmit_package(uint8_t *data, size_t len);
+int xmodem_transmit_package(xmodem_t *xm, uint8_t *data, size_t len);
+
+/**
+ * Switch XMODEM to transmit mode, gathering data from a list of buffers.
+ *
+ * Same as xmodem_transmit_package(), but the data to send is the
+ * concatenation of the passed segments. Frames are built directly from the
+ * segments (i.e., without intermediate copies).
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] iov    The list of buffers to send.
+ * @param[in] iovcnt The number of segments in the list (at most
+ * 		     XMODEM_MAX_IOV).
+ *
+ * @return Number of bytes actually transmitted (including padding) on success,
+ * 	   negative error code otherwise.
+ * @retval >0 Number of sent bytes (including padding).
+ * @retval -1 Error (timeout or number of retries exceeded).
+ */
+int xmodem_transmit_iov(xmodem_t *xm, const xmodem_iovec_t *iov, int iovcnt);
+
+/**
+ * Enable or disable XMODEM-1K transmission.
+ *
+ * When enabled, xmodem_transmit_package() sends 1024 bytes (STX) frames
+ * instead of 128 bytes (SOH) ones, falling back to 128 bytes frames for the
+ * tail of the data. If the receiver keeps rejecting a 1024 bytes frame,
+ * XMODEM-1K is disabled and the transfer continues with 128 bytes frames.
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] enable Non-zero to enable XMODEM-1K, 0 to disable it.
+ */
+void xmodem_set_1k(xmodem_t *xm, int enable);
+
+/**
+ * Set the XMODEM transmit window.
+ *
+ * With a window of 1 frame (the default), XMODEM is stop-and-wait: every frame
+ * must be acknowledged before the next one is sent. With a bigger window, up
+ * to 'frames' frames are sent before waiting for an ACK and lost frames are
+ * retransmitted go-back-N style. This requires a receiver that follows every
+ * ACK / NAK with the sequence number of the frame it refers to (ACKs being
+ * cumulative).
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] frames The number of frames that can be outstanding.
+ *
+ * @return Error status.
+ * @retval 0       Success.
+ * @retval -EINVAL The window is 0 or bigger than XMODEM_MAX_WINDOW.
+ */
+int xmodem_set_window(xmodem_t *xm, unsigned int frames);
+
+/**
+ * Enable or disable short frames transmission.
+ *
+ * When enabled, the tail of the data that does not fill a 128 bytes frame is
+ * sent in a short frame (see XMODEM_SOH_SHORT) instead of being padded. Only
+ * enable it if the receiver is known to support short frames.
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] enable Non-zero to enable short frames, 0 to disable them.
+ */
+void xmodem_set_short(xmodem_t *xm, int enable);
+
+/**
+ * Get the statistics of an XMODEM session.
+ *
+ * @param[in]  xm    The XMODEM session.
+ * @param[out] stats The statistics.
+ */
+void xmodem_get_stats(const xmodem_t *xm, xmodem_stats_t *stats);
+
+/**
+ * Drop the received bytes not processed yet and the state of the peer.
+ *
+ * To be used when the peer is reset (e.g., detached again after a failure).
+ *
+ * @param[in] xm The XMODEM session.
+ */
+void xmodem_flush(xmodem_t *xm);
+
+/**
+ * Bound all the timeouts.
+ *
+ * To be used while probing a link that may not work (e.g., after a speed
+ * change), so that failing takes a fraction of the usual time.
+ *
+ * @param[in] xm The XMODEM session.
+ * @param[in] ms The longest timeout in milliseconds, or 0 for no bound.
+ */
+void xmodem_set_max_timeout(xmodem_t *xm, int ms);
+
+/**
+ * Enable or disable turnaround mode.
+ *
+ * In turnaround mode the peer replies to a transmission (typically a QDA
+ * request) right after acknowledging its EOT, so the next reception does not
+ * start with a 'C'. A 'C' is still sent if nothing arrives before the
+ * timeout. Only enable it if the peer is known to support it.
+ *
+ * @param[in] xm     The XMODEM session.
+ * @param[in] enable Non-zero to enable turnaround mode, 0 to disable it.
+ */
+void xmodem_set_turnaround(xmodem_t *xm, int enable);
+
+/**
+ * Update a CRC.
+ *
+ * This function updates a CRC 16bits CCITT with the passed data, which means:
+ * - with CRC initialized to 0x0000 (XMODEM-CRC flavor)
+ * - with 16 'zero' bits implicitly appended to the end of the message
+ * - 0x1021 for the polynomial
+ *
+ * The CRC of a message can therefore be computed incrementally, starting from
+ * 0 and feeding the message in chunks of arbitrary size (including single
+ * bytes, as they are received).
+ *
+ * @param[in] crc  The CRC computed so far (0 for a new message).
+ * @param[in] data The data to add to the CRC.
+ * @param[in] len  The length of the data.
+ *
+ * @return The updated CRC value.
+ */
+uint16_t crc_xmodem_update(uint16_t crc, const uint8_t *data, size_t len);
 
 /**
  * @}